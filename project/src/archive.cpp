@@ -0,0 +1,161 @@
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <unistd.h>
+#include "archive.h"
+
+const string Archive::magic = "!<asmar>\n";
+
+Archive::Archive(string _path): path(_path), indexAt(-1) { }
+
+// offset of the index from the footer, -1 if there is no archive yet
+long long Archive::readFooter(ifstream& in){
+    if(!in.is_open()) return -1;
+    string head(magic.size(), '\0');
+    in.read(&head[0], head.size());
+    in.seekg(0, ios::end);
+    long long size = in.tellg();
+    if(head != magic || size < (long long)magic.size() + footerSize){
+        cout << "Error - " << path << " is not an archive." << endl;
+        exit(2);
+    }
+    string footer;
+    in.seekg(size - footerSize);
+    getline(in, footer);
+    return atoll(footer.c_str() + 10);
+}
+
+// reads the index of an existing archive, false if there is none yet
+bool Archive::load(){
+    ifstream in(path, ios::binary);
+    if((indexAt = readFooter(in)) == -1) return false;
+    in.seekg(indexAt);
+    string line;
+    getline(in, line);
+    long long count = atoll(line.c_str() + 7);
+    index.clear();
+    for(long long i = 0; i < count && getline(in, line); ++i){
+        istringstream record(line);
+        ArchiveEntry entry;
+        record >> entry.symbol >> entry.member;
+        index.push_back(entry);
+    }
+    return true;
+}
+
+// defined global symbols from the symbol table at the start of a listing
+vector<string> Archive::globalSymbols(const string& object){
+    vector<string> globals;
+    istringstream in(object);
+    string line;
+    getline(in, line); // LABEL    SECTION    OFFSET    SCOPE    S.N.
+    while(getline(in, line) && line.find_first_not_of(" \t\r") != string::npos){
+        istringstream fields(line);
+        string name, section, offset, scope;
+        if(fields >> name >> section >> offset >> scope && scope == "global" && section != ".und")
+            globals.push_back(name);
+    }
+    return globals;
+}
+
+// adds the objects as members; a member with the same name is marked stale
+// and its symbols leave the index. Every object is read before the archive is
+// touched, so a missing input leaves it as it was.
+void Archive::update(const vector<string>& objects){
+    vector<pair<string, string>> inputs; // member name, object
+    for(auto& objectName : objects){
+        ifstream objectFile(objectName, ios::binary);
+        if(!objectFile.is_open()){
+            cout << "Error opening file " << objectName << "." << endl;
+            exit(2);
+        }
+        string object((istreambuf_iterator<char>(objectFile)), istreambuf_iterator<char>());
+        inputs.push_back({ objectName.substr(objectName.find_last_of('/') + 1), object });
+    }
+
+    if(!load()){
+        ofstream create(path, ios::binary);
+        create << magic;
+        indexAt = magic.size();
+    }
+
+    fstream archive(path, ios::in | ios::out | ios::binary);
+    if(!archive.is_open()){
+        cout << "Error opening archive " << path << "." << endl;
+        exit(2);
+    }
+    vector<pair<string, long long>> members; // active members: name, header offset
+    for(long long offs = magic.size(); offs < indexAt; ){
+        string header;
+        archive.seekg(offs);
+        getline(archive, header);
+        if(header[21] == 'A') members.push_back({ header.substr(23), offs });
+        offs += header.size() + 1 + atoll(header.c_str() + 8);
+    }
+
+    long long end = indexAt;
+    archive.close();
+    if(truncate(path.c_str(), end) != 0){
+        cout << "Error writing archive " << path << "." << endl;
+        exit(2);
+    }
+    archive.open(path, ios::in | ios::out | ios::binary);
+    for(auto& input : inputs){
+        const string& name = input.first;
+        const string& object = input.second;
+
+        for(auto& member : members)
+            if(member.second != -1 && member.first == name){
+                archive.seekp(member.second + 21);
+                archive.put('S');
+                long long stale = member.second;
+                index.erase(remove_if(index.begin(), index.end(),
+                    [stale](const ArchiveEntry& e){ return e.member == stale; }), index.end());
+                member.second = -1;
+            }
+
+        archive.seekp(end);
+        archive << "#member " << setfill('0') << setw(12) << object.size() << " A " << name << "\n" << object;
+        for(auto& symbol : globalSymbols(object)) index.push_back({ symbol, end });
+        members.push_back({ name, end });
+        end = archive.tellp();
+    }
+
+    stable_sort(index.begin(), index.end(), [](const ArchiveEntry& a, const ArchiveEntry& b){ return a.symbol < b.symbol; });
+    int width = 1;
+    for(auto& entry : index) width = max(width, (int)entry.symbol.size());
+    archive.seekp(end);
+    archive << "#index " << setfill('0') << setw(12) << index.size() << " " << setw(4) << width << "\n";
+    for(auto& entry : index)
+        archive << setfill(' ') << setw(width) << left << entry.symbol << " " << setfill('0') << setw(12) << right << entry.member << "\n";
+    archive << "#index-at " << setfill('0') << setw(12) << end << "\n";
+}
+
+// binary search over the fixed width index records; name of the member
+// that defines the symbol, empty if there is none
+string Archive::find(const string& symbol){
+    ifstream in(path, ios::binary);
+    long long at = readFooter(in);
+    if(at == -1) return "";
+    string line;
+    in.seekg(at);
+    getline(in, line);
+    long long count = atoll(line.c_str() + 7), start = at + line.size() + 1;
+    int width = atoi(line.c_str() + 20), recordSize = width + 14;
+
+    long long lo = 0, hi = count;
+    while(lo < hi){
+        long long mid = (lo + hi) / 2;
+        in.seekg(start + mid * recordSize);
+        getline(in, line);
+        if(line.substr(0, line.find(' ')) < symbol) lo = mid + 1;
+        else hi = mid;
+    }
+    if(lo == count) return "";
+    in.seekg(start + lo * recordSize);
+    getline(in, line);
+    if(line.substr(0, line.find(' ')) != symbol) return "";
+    in.seekg(atoll(line.c_str() + width + 1));
+    getline(in, line);
+    return line.substr(23);
+}
@@ -0,0 +1,44 @@
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// ar-like bundle of assembler outputs:
+//   !<asmar>
+//   #member <size:12> <A|S> <name>     followed by <size> bytes of the object (S - stale, replaced later)
+//   ...
+//   #index <count:12> <width:4>        sorted records "<global symbol padded to width> <member offset:12>"
+//   #index-at <offset:12>              footer, where the index starts
+// New members are written over the old index, so adding or replacing one
+// never rewrites the members already in the archive.
+struct ArchiveEntry {
+    string symbol;
+    long long member;       // offset of the member header
+};
+
+class Archive{
+public:
+    Archive(string _path);
+
+    void update(const vector<string>& objects);
+    string find(const string& symbol);
+
+    static const string magic;
+    static const int footerSize = 23;
+
+private:
+    string path;
+    vector<ArchiveEntry> index;
+    long long indexAt;
+
+    long long readFooter(ifstream& in);
+    bool load();
+    static vector<string> globalSymbols(const string& object);
+};
+
+#endif
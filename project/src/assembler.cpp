@@ -1,5 +1,9 @@
 #include <iomanip>
+#include <cstring>
+#include <climits>
+#include <algorithm>
 #include "assembler.h"
+#include "pipeline.h"
 
 map<Instruction, int> Assembler::instrNumOper = {
     { Instruction::HALT, 0 },
@@ -85,15 +89,38 @@ map<string, Instruction> Assembler::instrName = {
     { "shr", Instruction::SHR }
 };
 
-map<SectionType, string> Assembler::sectionCode = {
-    { SectionType::START, ".start" },
-    { SectionType::TEXT, ".text" },
-    { SectionType::DATA, ".data" },
-    { SectionType::BSS, ".bss" },
-    { SectionType::RODATA, ".rodata" },
-    { SectionType::UND, ".und" }
+// estimated cycles: execution of the instruction itself, including its fetch ...
+map<Instruction, int> Assembler::instrCost = {
+    { Instruction::HALT, 1 },
+    { Instruction::IRET, 5 },
+    { Instruction::RET, 3 },
+    { Instruction::INT, 6 },
+    { Instruction::CALL, 4 },
+    { Instruction::JMP, 2 },
+    { Instruction::JEQ, 2 },
+    { Instruction::JNE, 2 },
+    { Instruction::JGT, 2 },
+    { Instruction::PUSH, 2 },
+    { Instruction::POP, 2 },
+    { Instruction::XCHG, 3 },
+    { Instruction::MOV, 1 },
+    { Instruction::ADD, 1 },
+    { Instruction::SUB, 1 },
+    { Instruction::MUL, 4 },
+    { Instruction::DIV, 12 },
+    { Instruction::CMP, 1 },
+    { Instruction::NOT, 1 },
+    { Instruction::AND, 1 },
+    { Instruction::OR, 1 },
+    { Instruction::XOR, 1 },
+    { Instruction::TEST, 1 },
+    { Instruction::SHL, 1 },
+    { Instruction::SHR, 1 }
 };
 
+// ... plus the operand access, by addressing mode: immed, regdir, regind, regindpom, mem
+int Assembler::modeCost[5] = { 0, 0, 2, 3, 2 };
+
 map<OperandType, regex> Assembler::opTypeRgx = {
 	{ op_dec, regex("(\\$)([0-9]+)") },											// $<literal>			neposredna vrednost
 	{ op_sym_val, regex("(\\$)([a-zA-Z_][a-zA-Z0-9]*)") }, 						// $<simbol>			neposredna vrednost
@@ -116,83 +143,63 @@ map<OperandType, regex> Assembler::opTypeRgx = {
 	{ jmp_op_sym_mem, regex("(\\*)([a-zA-Z_][a-zA-Z0-9]*)") }							// *<simbol>     		skok na adresu iz memorije na adresi <simbol>
 };
 
-Assembler::Assembler(ifstream& in, ofstream& out): outputFile(out), locationCnt(0), jmpFlag(false) {
+Assembler::Assembler(istream& in, ostream& out, const AsmOptions& opt): locationCnt(0), relocsEliminated(0), alignPadStart(-1), alignPadEnd(-1), outputFile(out), options(opt), conditionals(false), jmpFlag(false) {
+    static const char* predefined[] = { ".start", ".text", ".data", ".bss", ".rodata", ".und" };
+    for (int id = START; id <= UND; ++id) {
+        sections.push_back(Section(predefined[id], 0));
+        sectionIndex[predefined[id]] = id;
+    }
     parseInput(in);
 }
 
-Assembler::~Assembler(){ }
+Assembler::~Assembler(){
+    for (auto& section : sections)
+        if (section.spill) fclose(section.spill);
+    for (FILE* spill : relocSpill)
+        if (spill) fclose(spill);
+}
 
 void Assembler::compile(){
 
     currSection = START;
-    addSymbol(sectionCode[UND], UND, locationCnt, LOCAL, SECTION, 0, true);
-	string textLabel = "", rodataLabel = "";
-
-    for(auto& lineQ: asmInput){
-
-        currToken = (TokenType) tokenParser(lineQ.front());
+    sections[UND].symbol = addSymbol(sections[UND].name, UND, locationCnt, LOCAL, SECTION, 0, true);
+	int textLabel = -1, rodataLabel = -1;
+	bool blockStart = true; // --instrument: next instruction starts a basic block
+
+    for(int row = 0; ; ++row){
+        if (row == asmInput.size() && !(options.memoryBudget && streamBlock(row))) break;
+        queue<string>& lineQ = asmInput[row];
+        currRow = row;
+
+        currToken = (TokenType) rowKind[row].first;
+        if (options.watch)
+            lineState.push_back({ locationCnt, (int)symbolTable.size(), textLabel, code.rows(), (unsigned char)currSection, (unsigned char)currToken });
         string tokenName;
 
         if(currToken == LABEL){
             tokenName = lineQ.front().substr(0, lineQ.front().size() - 1);
-			if (textLabel != "" && currSection == TEXT && textLabel != tokenName)
-				symbolTable.find(textLabel)->second.size = locationCnt - symbolTable.find(textLabel)->second.offset;
-			if (currSection == TEXT) textLabel = tokenName;
-			if (currSection == RODATA) rodataLabel = tokenName;
             lineQ.pop();
 
-			if (symbolTable.find(tokenName) != symbolTable.end()) {
-				updateSymbol(tokenName, currSection, locationCnt, currToken, true);
-				for (int i = 0; i < symbolTable.find(tokenName)->second.flink.size(); ++i) {
-					if (symbolTable.find(tokenName)->second.flink[i].patch < 0) { //equ
-						string equName = symbolTable.find(tokenName)->second.flink[i].name;
-						int sign = symbolTable.find(tokenName)->second.flink[i].equ_sign;
-						symbolTable.find(equName)->second.offset += sign * locationCnt;
-						if(--symbolTable.find(equName)->second.size)
-							symbolTable.find(equName)->second.defined = true;
-					}
-					else {
-						int j = 0, old_j = 0, offset = -1;
-						string bytesStr = ""; Section* section = 0;
-						int relocIndex = 0;
-						while (j < relocations.size())
-							if (relocations[j++].name == tokenName && relocations[j - 1].offset == symbolTable.find(tokenName)->second.flink[i].patch) {
-								offset = relocations[--j].offset;
-								section = &(sections[relocations[j].section]);
-								relocIndex = j;
-								break;
-							}
-						if (symbolTable.find(tokenName)->second.scope == GLOBAL) continue;
-						if (offset == -1) {
-							cout << "Error - relocation.\n"; exit(3);
-						}
-						for (int i = 0, j = 0; i < section->size; i++) {
-							if (j >= offset) break;
-							if (section->content.find(i) != section->content.end()) {
-								bytesStr = section->content.find(i)->second;
-								old_j = j;
-								j += bytesStr.length() / 2;
-							}
-							else continue;
-						}
-						offset -= old_j;
-						string replacement = decToHex(locationCnt, 2);	
-						bytesStr.replace(offset * 2, 4, replacement.substr(2, 2) + replacement.substr(0, 2));
-						section->content.find(old_j)->second = bytesStr;
-						if (section->name == sectionCode[symbolTable.find(tokenName)->second.section])
-							relocations.erase(relocations.begin() + relocIndex);
-					}
-				}
-				symbolTable.find(tokenName)->second.flink.clear();
-				
+			int id = symbolId(tokenName);
+			if (id != -1) {
+				updateSymbol(id, currSection, locationCnt, currToken, true);
+				resolveForwardRefs(id);
+			}
+            else id = addSymbol(tokenName, currSection, locationCnt, LOCAL, currToken, 0, true);
+
+			if (textLabel != -1 && currSection == TEXT && textLabel != id)
+				symbolTable[textLabel].size = codeEnd() - symbolTable[textLabel].offset;
+			if (currSection == TEXT) {
+				textLabel = id;
+				blockStart = true;
 			}
-            else addSymbol(tokenName, currSection, locationCnt, LOCAL, currToken, 0, true);
+			if (currSection == RODATA) rodataLabel = id;
 
             if(lineQ.empty()) continue;
         }
 
         tokenName = lineQ.front();
-        currToken = (TokenType) tokenParser(tokenName);
+        currToken = (TokenType) rowKind[row].second;
         lineQ.pop();
 
         switch (currToken)
@@ -207,193 +214,592 @@ void Assembler::compile(){
 		case SECTION:
 			tokenName = lineQ.front();
 			lineQ.pop();
-			if(regex_match(tokenName, regex("(\\.)(text|data|bss|rodata)")))
-				sections.insert({ tokenName, Section(tokenName, locationCnt) }); 
 			if (currSection != START) {
-				sections.find(sectionCode[currSection])->second.size = locationCnt;
-				symbolTable.find(sectionCode[currSection])->second.size = locationCnt;
+				sections[currSection].size = locationCnt;
+				symbolTable[sections[currSection].symbol].size = locationCnt;
 			}
 			//updateSection
-            locationCnt = 0;
-            for(auto i: sectionCode){
-                if(i.second == tokenName){
-                    currSection = i.first; 
-                    break;
-                }
-			}
-			if(symbolTable.find(tokenName) == symbolTable.end()) addSymbol(tokenName, currSection, locationCnt, LOCAL, currToken, 0, true);
-			else updateSymbol(tokenName, currSection, locationCnt, currToken, true);
+			currSection = openSection(tokenName, lineQ);
+            locationCnt = sections[currSection].size; // a section opened again goes on where it stopped
+			alignPadEnd = -1;
 			break;
 		case EXT_GLB:
 			while (!lineQ.empty()) {
 				tokenName = lineQ.front();
 				lineQ.pop();
-				if (symbolTable.find(tokenName) != symbolTable.end())
-					symbolTable.find(tokenName)->second.scope = GLOBAL;
+				int id = symbolId(tokenName);
+				if (id != -1 && id < encodedRefs.size() && encodedRefs[id] && symbolTable[id].defined) {
+					cout << "Error - With --memory " << tokenName << " has to be made global before instructions use it." << endl;
+					exit(1);
+				}
+				if (symbolId(tokenName) != -1)
+					symbolTable[symbolId(tokenName)].scope = GLOBAL;
 				else
 					addSymbol(tokenName, UND, 0, GLOBAL, SYMBOL, 0, false);
 			}
 			break;
 		case INSTRUCTION:
-			if (currSection != TEXT){
-				cout << "Instructions can't be defined outside of text section." << endl;
+			if (!sections[currSection].code()){
+				cout << "Instructions can't be defined outside of a code (\"x\") section." << endl;
                 exit(1);
             }
-			instructionHandler(tokenName, lineQ);
+			{
+				string dst = lineQ.empty() ? "" : lineQ.back();
+				if (options.instrument && blockStart && currSection == TEXT) insertCounter(textLabel);
+				Instruction instr = instrName[tokenName];
+				instructionHandler(tokenName, lineQ, inputLines[row]);
+				if (endsFlow(instr, dst) && currSection == TEXT) flowEnds.push_back(locationCnt);
+				blockStart = (instr == JMP || instr == JEQ || instr == JNE || instr == JGT
+					|| instr == CALL || instr == RET || instr == IRET);
+			}
 			break;
 		case END:
-			sections.insert({ tokenName, Section(tokenName, locationCnt) });
 			if (currSection != START) {
-				sections.find(sectionCode[currSection])->second.size = locationCnt;
-				symbolTable.find(sectionCode[currSection])->second.size = locationCnt;
+				sections[currSection].size = locationCnt;
+				symbolTable[sections[currSection].symbol].size = locationCnt;
 			}
 
-			if (textLabel != "" && currSection == TEXT && textLabel != tokenName)
-				symbolTable.find(textLabel)->second.size = locationCnt - symbolTable.find(textLabel)->second.offset;
-			if (currSection == TEXT) textLabel = tokenName;
+			if (textLabel != -1 && currSection == TEXT)
+				symbolTable[textLabel].size = codeEnd() - symbolTable[textLabel].offset;
 			break;
 		default:
 			cout << "Wrong token." << endl;
             exit(1);
 		}
     }
+	encodeInstructions();
+	// relocations of instructions come last, keep the listing in offset order
+	stable_sort(relocations.begin(), relocations.end(), [](const Reloc& a, const Reloc& b) {
+		return a.section < b.section || (a.section == b.section && a.offset < b.offset); });
 	for (auto& it : symbolTable)
-		if (!it.second.defined) it.second.scope = GLOBAL; 
+		if (!it.defined) it.scope = GLOBAL; 
+	relocations.erase(remove_if(relocations.begin(), relocations.end(), [](const Reloc& r) { return r.symbol == -1; }),
+		relocations.end());
+
+	if (options.instrument) allocateCounters();
+	if (options.gcFunctions) gcFunctions();
+	if (!options.layoutProfile.empty()) reorderText();
+	if (options.mergeRodata) mergeRodata();
+	writeListing();
+}
+
+// .section <name>[, "<flags>"][, @nobits|@progbits] - returns the section id, a new name gets
+// the next one; flags and type are taken when the section is opened for the first time
+int Assembler::openSection(const string& name, queue<string>& tokens){
+	static const regex sectionName{ "\\.?[a-zA-Z_][a-zA-Z0-9_.]*" };
+	string flags, type;
+	for (; !tokens.empty(); tokens.pop()) {
+		const string& arg = tokens.front();
+		if (arg.length() >= 2 && arg[0] == '"' && arg[arg.length() - 1] == '"' && arg.find_first_not_of("awx", 1) == arg.length() - 1)
+			flags = arg.substr(1, arg.length() - 2);
+		else if (arg == "@nobits" || arg == "@progbits") type = arg;
+		else {
+			cout << "Error - Invalid .section argument " << arg << "." << endl;
+			exit(1);
+		}
+	}
+	if (!regex_match(name, sectionName) || name == sections[START].name || name == sections[UND].name) {
+		cout << "Error - Invalid section name " << name << "." << endl;
+		exit(1);
+	}
 
+	int id;
+	auto found = sectionIndex.find(name);
+	if (found != sectionIndex.end()) id = found->second;
+	else {
+		if (sections.size() > UCHAR_MAX) { // ids are kept in a byte
+			cout << "Error - Too many sections." << endl;
+			exit(1);
+		}
+		id = sections.size();
+		sections.push_back(Section(name, 0, flags));
+		sectionIndex[name] = id;
+	}
+	Section& section = sections[id];
+	if (!section.used) {
+		section.used = true;
+		if (!flags.empty()) section.flags = flags;
+		if (!type.empty()) section.nobits = (type == "@nobits");
+		section.symbol = symbolId(name);
+		if (section.symbol == -1) section.symbol = addSymbol(name, id, 0, LOCAL, SECTION, 0, true);
+		else updateSymbol(section.symbol, id, 0, SECTION, true);
+	}
+	return id;
+}
+
+void Assembler::writeListing(){
 	// simboli:
 	outputFile << "  LABEL    SECTION    OFFSET    SCOPE    S.N." << endl;
-	for (int i = 0; i < symbols.size(); ++i) {
-		outputFile << "  " << setfill(' ') << setw(9) << left << symbolTable.find(symbols[i])->second.label;
-		outputFile << setfill(' ') << setw(13) << sectionCode[symbolTable.find(symbols[i])->second.section];
-		outputFile << setfill(' ') << setw(8) << hex << symbolTable.find(symbols[i])->second.offset;
-		outputFile << setfill(' ') << setw(10) << ((symbolTable.find(symbols[i])->second.scope == GLOBAL) ? "global" : "local");
-		outputFile << setfill(' ') << setw(6) << symbolTable.find(symbols[i])->second.serialNum << endl;
+	for (int i = 0; i < symbolTable.size(); ++i) {
+		outputFile << "  " << setfill(' ') << setw(9) << left << symbolName(i);
+		outputFile << setfill(' ') << setw(13) << sections[symbolTable[i].section].name;
+		int value = symbolTable[i].offset;
+		if (value < 0) outputFile << "-" << setfill(' ') << setw(7) << hex << -value; // .equ, signed to fit the column
+		else outputFile << setfill(' ') << setw(8) << hex << value;
+		outputFile << setfill(' ') << setw(10) << ((symbolTable[i].scope == GLOBAL) ? "global" : "local");
+		outputFile << setfill(' ') << setw(6) << i << endl;
 	}
+	if (options.hashIndex) writeHashIndex();
 	// sekcije
-	if (sections.find(sectionCode[TEXT]) != sections.end()) {
-		outputFile << endl << endl << "  #.text" << endl;
-		for (int i = 0, j = 0; i < sections[sectionCode[TEXT]].size; i++) {
-			if (sections[sectionCode[TEXT]].content.find(i) != sections[sectionCode[TEXT]].content.end()) {
-				string bytes = sections[sectionCode[TEXT]].content.find(i)->second;
-				outputFile << setfill(' ') << setw(3) << right<< hex << j << ":  ";
-				for (int k = 0; k < bytes.length(); k++) {
-					if ((k != 0) && (k % 2 == 0)) outputFile << " ";
-					outputFile << bytes[k];
-				}
-				j += bytes.length() / 2;
-				outputFile << endl;
-			}
-			else continue;
-		}
-	}
-	if (sections.find(sectionCode[DATA]) != sections.end()) {
-		outputFile << endl << "  #.data" << endl << " ";
-		for (int i = 0; i < sections[sectionCode[DATA]].size; i++) {
-			if (sections[sectionCode[DATA]].content.find(i) != sections[sectionCode[DATA]].content.end()) {
-				string bytes = sections[sectionCode[DATA]].content.find(i)->second;
-				for (int k = 0; k < bytes.length(); k++) {
-					if ((k != 0) && (k % 2 == 0)) outputFile << " ";
-					outputFile << bytes[k];
-				}
-				outputFile << " ";
-			}
-			else continue;
+	for (int id = TEXT; id < sections.size(); ++id) {
+		Section& section = sections[id];
+		if (!section.used || section.nobits) continue;
+		if (section.code()) writeCodeBytes(section, id == TEXT);
+		else {
+			outputFile << endl << "  #" << section.name << alignNote(section) << endl << " ";
+			writeDataBytes(section);
+			outputFile << endl;
 		}
-		outputFile << endl;
+		if (id == TEXT && options.annotateCost) writeCosts();
 	}
-	if (sections.find(sectionCode[RODATA]) != sections.end()) {
-		outputFile << endl << "  #.rodata" << endl << " ";
-		for (int i = 0; i < sections[sectionCode[RODATA]].size; i++) {
-			if (sections[sectionCode[RODATA]].content.find(i) != sections[sectionCode[RODATA]].content.end()) {
-				string bytes = sections[sectionCode[RODATA]].content.find(i)->second;
-				for (int k = 0; k < bytes.length(); k++) {
-					if ((k != 0) && (k % 2 == 0)) outputFile << " ";
-					outputFile << bytes[k];
-				}
-				outputFile << " ";
+	if (options.instrument) writeCounters();
+	// relokacije:
+	for (int id = TEXT; id < sections.size(); ++id)
+		writeRelocations(id);
+	outputFile << endl;
+	
+}
+
+// one "offset:  bytes" row per instruction, with the estimated cycles of .text instructions
+void Assembler::writeCodeBytes(Section& section, bool annotate){
+	outputFile << endl << endl << "  #" << section.name << alignNote(section) << endl;
+	section.forEachChunk([this, annotate](int offs, const string* bytes, int zeros) {
+		if (bytes) {
+			outputFile << setfill(' ') << setw(3) << right << hex << offs << ":  ";
+			string line;
+			for (int k = 0; k < bytes->length(); k++) {
+				if ((k != 0) && (k % 2 == 0)) line += " ";
+				line += (*bytes)[k];
 			}
-			else continue;
+			auto cost = annotate ? costs.find(offs) : costs.end();
+			if (cost != costs.end()) outputFile << setw(22) << left << line << "; " << dec << cost->second;
+			else outputFile << line;
+			outputFile << endl;
 		}
-		outputFile << endl;
-	}
-	// relokacije:
-	int offs = 0, sn = 0;
-	outputFile << endl << endl << "  #.rel.text" << endl;
-	for (int i = 0; i < relocations.size(); ++i) {
-		if (relocations[i].section != ".text") continue;
-		if (symbolTable.find(relocations[i].name)->second.scope == LOCAL && relocations[i].type == PCREL)
-			offs = symbolTable.find(relocations[i].name)->second.offset;
-		else offs = relocations[i].offset;
-		if (symbolTable.find(relocations[i].name)->second.scope == GLOBAL)
-			sn = symbolTable.find(relocations[i].name)->second.serialNum;
-		else sn = symbolTable.find(sectionCode[symbolTable.find(relocations[i].name)->second.section])->second.serialNum;
+		else for (int k = 0; k < zeros; k++)
+			outputFile << setfill(' ') << setw(3) << right << hex << offs + k << ":  00" << endl;
+	});
+}
+
+// #.rel.text and #.rel.data are always written, the other sections only when they have relocations;
+// relocations against local symbols name the section symbol
+void Assembler::writeRelocations(int id){
+	FILE* spill = (id < relocSpill.size()) ? relocSpill[id] : nullptr;
+	bool any = spill || any_of(relocations.begin(), relocations.end(), [id](const Reloc& r) { return r.section == id; });
+	if (!any && id != TEXT && id != DATA) return;
+	outputFile << endl << endl << "  #.rel" << sections[id].name << endl << right;
+	auto write = [this](const Reloc* reloc) {
+		Symbol& symbol = symbolTable[reloc->symbol];
+		int offs = (symbol.scope == LOCAL && reloc->type == PCREL) ? symbol.offset : reloc->offset;
+		int sn = (symbol.scope == GLOBAL) ? reloc->symbol : sections[symbol.section].symbol;
 		outputFile << " " << setfill('0') << setw(8) << hex << offs;
-		outputFile << setfill(' ') << setw(16) << ((relocations[i].type == ABS) ? "R_x86_64_32" : "R_x86_64_PC32");
+		outputFile << setfill(' ') << setw(16) << ((reloc->type == ABS) ? "R_x86_64_32" : "R_x86_64_PC32");
 		outputFile << setfill(' ') << setw(5) << dec << sn;
-		//outputFile << setfill(' ') << setw(5) << dec << relocations[i].addend;
+		//outputFile << setfill(' ') << setw(5) << dec << reloc->addend;
 		outputFile << endl;
+	};
+	// --memory: the spilled relocations are merged in by offset
+	Reloc spilled(-1, id, 0, ABS, 0);
+	bool more = false;
+	if (spill) {
+		rewind(spill);
+		more = fread(&spilled, sizeof(Reloc), 1, spill) == 1;
 	}
-	outputFile << endl << endl << "  #.rel.data" << endl;
-	for (int i = 0; i < relocations.size(); ++i) {
-		if (relocations[i].section != ".data") continue;
-		outputFile << " " << setfill('0') << setw(8) << hex << relocations[i].offset;
-		outputFile << setfill(' ') << setw(16) << ((relocations[i].type == ABS) ? "R_x86_64_32" : "R_x86_64_PC32");
-		outputFile << setfill(' ') << setw(5) << dec << symbolTable.find(relocations[i].name)->second.serialNum;
-		//outputFile << setfill(' ') << setw(5) << dec << relocations[i].addend;
-		outputFile << endl;
+	for (auto reloc = relocations.begin(); reloc != relocations.end(); ++reloc) {
+		if (reloc->section != id) continue;
+		for (; more && spilled.offset <= reloc->offset; more = fread(&spilled, sizeof(Reloc), 1, spill) == 1)
+			write(&spilled);
+		write(&*reloc);
 	}
-	outputFile << endl;
-	
+	for (; more; more = fread(&spilled, sizeof(Reloc), 1, spill) == 1)
+		write(&spilled);
+}
+
+// cycles per .text label (up to the next label) and the most expensive ones;
+// straight line estimate, loops and calls are not followed
+void Assembler::writeCosts(){
+	vector<pair<int, int>> totals; // cycles, symbol id
+	for (int i = 0; i < symbolTable.size(); ++i) {
+		Symbol& symbol = symbolTable[i];
+		if (symbol.section != TEXT || symbol.symType != LABEL || !symbol.defined) continue;
+		int cycles = 0;
+		for (auto it = costs.lower_bound(symbol.offset); it != costs.end() && it->first < symbol.offset + symbol.size; ++it)
+			cycles += it->second;
+		totals.push_back({ cycles, i });
+	}
+	sort(totals.begin(), totals.end(), [this](const pair<int, int>& a, const pair<int, int>& b) {
+		return symbolTable[a.second].offset < symbolTable[b.second].offset; });
+	outputFile << endl << "  #.text cost" << endl;
+	for (auto& total : totals)
+		outputFile << "  " << setfill(' ') << setw(9) << left << symbolName(total.second) << dec << total.first << endl;
+
+	stable_sort(totals.begin(), totals.end(), [](const pair<int, int>& a, const pair<int, int>& b) { return a.first > b.first; });
+	if (totals.size() > 10) totals.resize(10);
+	outputFile << endl << "  most expensive:" << endl;
+	for (auto& total : totals)
+		outputFile << "  " << setfill(' ') << setw(9) << left << symbolName(total.second) << dec << total.first << endl;
+	outputFile << right;
+}
+
+string Assembler::alignNote(Section& section){
+	return (section.align > 1) ? " (align " + to_string(section.align) + ")" : "";
+}
+
+void Assembler::writeDataBytes(Section& section){
+	section.forEachChunk([this](int, const string* bytes, int zeros) {
+		if (bytes) {
+			for (int k = 0; k < bytes->length(); k++) {
+				if ((k != 0) && (k % 2 == 0)) outputFile << " ";
+				outputFile << (*bytes)[k];
+			}
+			outputFile << " ";
+		}
+		else for (int k = 0; k < zeros; k++)
+			outputFile << "00 ";
+	});
+}
+
+// FNV-1a, --watch compares source lines by it
+size_t Assembler::lineHash(const char* line, size_t len){
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= (unsigned char)line[i];
+		hash *= 1099511628211ULL;
+	}
+	return (size_t)hash;
+}
+
+// the input comes from a reader thread in blocks of whole lines, a block is lexed
+// while the next one is read; with --memory compile() asks for the blocks one by one
+void Assembler::parseInput(istream& in){
+    if (options.memoryBudget) reader.reset(new InputPipe(in, max(options.memoryBudget / 64, (size_t)1 << 16), 2));
+    else reader.reset(new InputPipe(in, lexBlockSize()));
+    lineNum = 0;
+    inputEnd = false;
+    constants = options.defines;
+    if (!options.memoryBudget)
+        while (readBlock());
+}
+
+// lexes the next input block into asmInput, false at the end of the input
+bool Assembler::readBlock(){
+    string block;
+    if (!reader) return false;
+    if (inputEnd || !reader->pop(block)) {
+        reader.reset();
+        if(!conds.empty()){
+            cout << "Error - Missing .endif." << endl;
+            exit(1);
+        }
+        return false;
+    }
+    LexedChunk lexed;
+    lexInput(block, lexed);
+    for(int k = 0, rows = lexed.spans.size(); k < rows && !inputEnd; ){
+        bool active = conds.empty() || conds.back().first;
+        int last = k + 1;
+        if(!lexed.guarded[k])
+            while(last < rows && !lexed.guarded[last]) last++;
+        if(!active && !lexed.guarded[k]){ // skipped block, not even tokenized
+            k = last;
+            continue;
+        }
+        lexRows(lexed, k, last);
+        for(; k < last && !inputEnd; ++k){
+            queue<string>& tokens = lexed.rows[k];
+            const string& dir = tokens.front();
+            if(dir == ".if" || dir == ".ifdef" || dir == ".ifndef" || dir == ".else" || dir == ".endif"){
+                conditionalHandler(tokens, conds);
+                continue;
+            }
+            if(!active) continue;
+            noteConstant(tokens);
+
+            inputEnd = (dir == ".end");
+            asmInput.push_back(move(tokens));
+            inputLines.push_back(lineNum + lexed.lines[k]);
+            rowKind.push_back(lexed.kinds[k]);
+            if(options.watch) rowHash.push_back(lexed.hashes[k]);
+        }
+    }
+    lineNum += lexed.lineCount;
+    return true;
+}
+
+// --memory: the rows compiled so far are dropped and the next block is read in their place,
+// row goes back to 0; false at the end of the input
+bool Assembler::streamBlock(int& row){
+    flushStream();
+    asmInput.clear();
+    inputLines.clear();
+    rowKind.clear();
+    while (asmInput.empty())
+        if (!readBlock()) return false;
+    row = 0;
+    return true;
+}
+
+// --memory: encodes the instructions of the block, except the ones whose expressions
+// name labels that aren't defined yet, and moves what is done to the temporary files
+// once the state gets over half of the budget (the rest is for the input blocks)
+void Assembler::flushStream(){
+    vector<bool> keep(code.rows(), false);
+    for (int row = 0; row < code.rows(); ++row)
+        for (int k = 0; k < code.numOper[row]; ++k)
+            if (code.ref[k][row] >= EXPR_ABS)
+                for (auto& name : exprNames(code.exprs[code.value[k][row]])) {
+                    int id = symbolId(name);
+                    if (id == -1 || !symbolTable[id].defined) keep[row] = true;
+                }
+    encodedRefs.resize(symbolTable.size());
+    for (int row = 0, first = 0; row <= code.rows(); ++row) {
+        if (row < code.rows() && !keep[row]) {
+            for (int k = 0; k < code.numOper[row]; ++k)
+                if (code.ref[k][row] == SYM_ABS || code.ref[k][row] == SYM_PCREL) encodedRefs[code.value[k][row]] = true;
+                else if (code.ref[k][row] != LITERAL)
+                    for (auto& name : exprNames(code.exprs[code.value[k][row]])) encodedRefs[symbolId(name)] = true;
+            continue;
+        }
+        encodeInstructions(first, row);
+        first = row + 1;
+    }
+    code.retain(keep);
+    fixups.clear();     // only the layout passes look at these
+    flowEnds.clear();
+    exprSites.clear();
+    if (residentBytes() <= options.memoryBudget / 2) return;
+
+    // bytes behind a waiting instruction can still change
+    vector<int> limit(sections.size(), INT_MAX);
+    for (int row = 0; row < code.rows(); ++row)
+        limit[code.section[row]] = min(limit[code.section[row]], code.offset[row]);
+    for (int id = 0; id < sections.size(); ++id)
+        limit[id] = min(limit[id], (id == currSection) ? locationCnt : sections[id].size);
+    spillRelocations(limit);
+    for (int id = 0; id < sections.size(); ++id)
+        if (!sections[id].nobits) sections[id].spillChunks(limit[id]);
+}
+
+// estimate of the memory held by the assembled bytes, relocations and instructions
+size_t Assembler::residentBytes(){
+    const size_t node = 48;   // map node
+    size_t bytes = relocations.size() * sizeof(Reloc) + refPool.size() * sizeof(forw_ref) + code.rows() * 32;
+    for (auto& section : sections) {
+        for (auto& chunk : section.content) bytes += node + chunk.second.capacity();
+        bytes += node * (section.zeroFill.size() + section.patches.size());
+    }
+    return bytes;
+}
+
+// --memory: relocations below limit against defined symbols are final, they go to the
+// temporary file of their section in offset order; the ones still waiting for a symbol
+// stay, and refPool is rebuilt with their new indices
+void Assembler::spillRelocations(const vector<int>& limit){
+    relocSpill.resize(sections.size(), nullptr);
+    vector<vector<Reloc>> done(sections.size());
+    vector<int> index(relocations.size(), -1);
+    int kept = 0;
+    for (int i = 0; i < relocations.size(); ++i) {
+        Reloc& reloc = relocations[i];
+        if (reloc.symbol == -1) continue;
+        if (symbolTable[reloc.symbol].defined && reloc.offset >= sections[reloc.section].spilledEnd && reloc.offset < limit[reloc.section])
+            done[reloc.section].push_back(reloc);
+        else {
+            index[i] = kept;
+            relocations[kept++] = reloc;
+        }
+    }
+    relocations.erase(relocations.begin() + kept, relocations.end());
+
+    for (int id = 0; id < sections.size(); ++id) {
+        if (done[id].empty()) continue;
+        stable_sort(done[id].begin(), done[id].end(), [](const Reloc& a, const Reloc& b) { return a.offset < b.offset; });
+        if (!relocSpill[id]) relocSpill[id] = tmpfile();
+        if (!relocSpill[id] || fwrite(done[id].data(), sizeof(Reloc), done[id].size(), relocSpill[id]) != done[id].size()) {
+            cout << "Error - Can't write the temporary file of " << sections[id].name << " relocations." << endl;
+            exit(1);
+        }
+    }
+
+    vector<forw_ref> pool;
+    for (auto& symbol : symbolTable) {
+        int first = -1, last = -1;
+        for (int ref = symbol.flink; ref != -1; ref = refPool[ref].next) {
+            forw_ref fr = refPool[ref];
+            if (fr.reloc >= 0) fr.reloc = index[fr.reloc];
+            fr.next = -1;
+            pool.push_back(fr);
+            if (last == -1) first = pool.size() - 1;
+            else pool[last].next = pool.size() - 1;
+            last = pool.size() - 1;
+        }
+        symbol.flink = first;
+    }
+    refPool.swap(pool);
 }
 
-void Assembler::parseInput(ifstream& in){
-    string line;
-    while(getline(in, line)){
-        // //line.erase(line.length() - 1);
-        queue<string> tokens;
+// .if <expr> / .ifdef <sym> / .ifndef <sym> / .else / .endif, evaluated while the input is read
+void Assembler::conditionalHandler(queue<string> tokens, vector<pair<bool, bool>>& conds){
+    string dir = tokens.front();
+    tokens.pop();
+    conditionals = true;
+    bool outer = conds.empty() || conds.back().first;
+    if(dir == ".else" || dir == ".endif"){
+        if(conds.empty()){
+            cout << "Error - " << dir << " without .if." << endl;
+            exit(1);
+        }
+        if(dir == ".endif") conds.pop_back();
+        else {
+            outer = conds.size() < 2 || conds[conds.size() - 2].first;
+            conds.back().first = outer && !conds.back().second;
+            conds.back().second = true;
+        }
+        return;
+    }
+    if(!outer){ // inside a skipped block, nothing is evaluated
+        conds.push_back({ false, true });
+        return;
+    }
+    string expr;
+    for(; !tokens.empty(); tokens.pop()) expr += tokens.front();
+    bool value;
+    if(dir == ".if") value = evalCondition(expr);
+    else {
+        if(expr.empty()){
+            cout << "Error - " << dir << " needs a symbol." << endl;
+            exit(1);
+        }
+        value = constants.count(expr) || parsedNames.count(expr);
+        if(dir == ".ifndef") value = !value;
+    }
+    conds.push_back({ value, value });
+}
 
-        size_t start = line.find_first_not_of(" ,\t");
-        size_t end = start;
-        while(start != string::npos){     // 'until the end of the string'
-            end = line.find_first_of(" ,\t", start);
-            tokens.push(line.substr(start, end - start));
-            start = line.find_first_not_of(" ,\t", end);
+// <sum> [==|!=|<|>|<=|>= <sum>], sums of decimal literals and constants
+bool Assembler::evalCondition(const string& expr){
+    static const char* ops[] = { "==", "!=", "<=", ">=", "<", ">" };
+    for(int i = 0; i < 6; ++i){
+        size_t pos = expr.find(ops[i]);
+        if(pos == string::npos) continue;
+        int left = evalSum(expr.substr(0, pos)), right = evalSum(expr.substr(pos + strlen(ops[i])));
+        switch(i){
+        case 0: return left == right;
+        case 1: return left != right;
+        case 2: return left <= right;
+        case 3: return left >= right;
+        case 4: return left < right;
+        default: return left > right;
         }
+    }
+    return evalSum(expr) != 0;
+}
 
-        if(tokens.size() == 0) continue;
-        if(tokens.front() == ".end"){
-            asmInput.push_back(tokens);
-            break;
+int Assembler::evalSum(const string& expr){
+    if(expr.empty()){
+        cout << "Error - Missing operand in .if." << endl;
+        exit(1);
+    }
+    int value = 0, helpInt = 0;
+    bool neg = false;
+    if(expr[0] == '-' || expr[0] == '+') neg = (expr[helpInt++] == '-');
+    while((unsigned)helpInt < expr.length()){
+        string op;
+        while(helpInt < expr.length() && expr[helpInt] != '+' && expr[helpInt] != '-') op += expr[helpInt++];
+        int term;
+        if(!op.empty() && strspn(op.c_str(), "0123456789") == op.size()) term = atoi(op.c_str());
+        else if(constants.count(op)) term = constants[op];
+        else {
+            cout << "Error - " << (op.empty() ? "Missing operand" : "Symbol " + op + " is not a constant") << " in .if." << endl;
+            exit(1);
         }
+        value += neg ? -term : term;
+        if(helpInt < expr.length()) neg = (expr[helpInt++] == '-');
+    }
+    return value;
+}
 
-        asmInput.push_back(tokens);
+// labels and .equ values seen so far, for .ifdef and .if
+void Assembler::noteConstant(const queue<string>& tokens){
+    const string& first = tokens.front();
+    if(first[first.length() - 1] == ':'){
+        parsedNames.insert(first.substr(0, first.length() - 1));
+        return;
+    }
+    if(first != ".equ" || tokens.size() < 3) return;
+    queue<string> rest = tokens;
+    rest.pop();
+    string name = rest.front();
+    rest.pop();
+    parsedNames.insert(name);
+    string expr;
+    for(; !rest.empty(); rest.pop()) expr += rest.front();
+    // only values built from literals and other constants
+    for(size_t pos = 0, end; pos < expr.length(); pos = end + 1){
+        end = expr.find_first_of("+-", pos);
+        if(end == string::npos) end = expr.length();
+        string op = expr.substr(pos, end - pos);
+        if(op.empty() && pos == 0) continue;
+        if(op.empty() || (strspn(op.c_str(), "0123456789") != op.size() && !constants.count(op))){
+            constants.erase(name);
+            return;
+        }
     }
+    constants[name] = evalSum(expr);
 }
 
-void Assembler::addSymbol(string label, SectionType sec, int offs, ScopeType scp, TokenType tok, int size, bool def){
+int Assembler::addSymbol(string label, int sec, int offs, ScopeType scp, TokenType tok, int size, bool def){
     
-    symbolTable.insert({ label, Symbol(label, sec, offs, scp, tok, size, def) });
-	symbols.push_back(label);
+	int id = symbolTable.size();
+    symbolTable.push_back(Symbol(strTab.size(), sec, offs, scp, tok, size, def));
+	symbolIndex.insert({ label, id });
+	strTab.insert(strTab.end(), label.begin(), label.end());
+	strTab.push_back('\0');
+	if (def) noteDefined(id);
+	return id;
+
+}
 
+// --watch: reassemble() only re-reads lines whose symbols got their values above the edit
+void Assembler::noteDefined(int id){
+	if (!options.watch) return;
+	if (definedRow.size() < symbolTable.size()) definedRow.resize(symbolTable.size(), INT_MAX);
+	definedRow[id] = currRow;
 }
 
-void Assembler::updateSymbol(string label, SectionType currSection, int locationCnt, TokenType currToken, bool def) {
-	symbolTable.find(label)->second.section = currSection;
-	symbolTable.find(label)->second.offset = locationCnt;
-	symbolTable.find(label)->second.symType = currToken;
-	if (currToken == SECTION) symbolTable.find(label)->second.scope = LOCAL;
-	symbolTable.find(label)->second.defined = def;
+void Assembler::updateSymbol(int id, int currSection, int locationCnt, TokenType currToken, bool def) {
+	Symbol& symbol = symbolTable[id];
+	symbol.section = currSection;
+	symbol.offset = locationCnt;
+	symbol.symType = currToken;
+	if (currToken == SECTION) symbol.scope = LOCAL;
+	symbol.defined = def;
+	if (def) noteDefined(id);
+}
+
+int Assembler::symbolId(const string& label) {
+	auto it = symbolIndex.find(label);
+	return (it == symbolIndex.end()) ? -1 : it->second;
+}
+
+const char* Assembler::symbolName(int id) {
+	return &strTab[symbolTable[id].name];
+}
+
+void Assembler::addForwardRef(int id, int reloc, int equ, int sign) {
+	refPool.push_back(forw_ref(reloc, equ, symbolTable[id].flink, sign));
+	symbolTable[id].flink = refPool.size() - 1;
 }
 
 TokenType Assembler::tokenParser(string token){
     TokenType tokType = INCORRECT;
 
-	regex label{ "([a-zA-Z][a-zA-Z0-9_]*:)" };
-	regex directive{ "\\.(byte|word|skip|equ)" };
-	regex instruction{ "(halt|iret|ret|int|call|jmp|jeq|jne|jgt|push|pop|xchg|mov|add|sub|mul|div|cmp|not|and|or|xor|test|shl|shr)?" };
-	regex symbol{ ("([a-zA-Z_][a-zA-Z0-9]*)") };
-	regex op_dec{ ("(\\$)([0-9]+)") };
-	regex end{ "(\\.)(end)" };
+	static const regex label{ "([a-zA-Z][a-zA-Z0-9_]*:)" };
+	static const regex directive{ "\\.(byte|word|skip|equ|incbin|align|p2align)" };
+	static const regex instruction{ "(halt|iret|ret|int|call|jmp|jeq|jne|jgt|push|pop|xchg|mov|add|sub|mul|div|cmp|not|and|or|xor|test|shl|shr)?" };
+	static const regex symbol{ ("([a-zA-Z_][a-zA-Z0-9]*)") };
+	static const regex op_dec{ ("(\\$)([0-9]+)") };
+	static const regex end{ "(\\.)(end)" };
 
 	if (!token.compare(".global") || !token.compare(".extern"))
 		return  EXT_GLB;
@@ -424,7 +830,93 @@ string Assembler::decToHex(int dec, int numOfBytes){
 	return hexx;
 }
 
-void Assembler::directiveHandler(string dir, queue<string>& tokens, string& label){
+// writes raw bytes as one chunk of upper case hex digits
+string Assembler::bytesToHex(const unsigned char* bytes, int len){
+	static const char digits[] = "0123456789ABCDEF";
+	string hexx(2 * len, '0');
+	for (int i = 0; i < len; ++i) {
+		hexx[2 * i] = digits[bytes[i] >> 4];
+		hexx[2 * i + 1] = digits[bytes[i] & 0xF];
+	}
+	return hexx;
+}
+
+// fast path for .byte/.word: consumes the leading run of decimal operands and
+// writes it as a single chunk, returns the number of values written
+int Assembler::writeNumbers(queue<string>& tokens, int width){
+	string bytes;
+	while (!tokens.empty()) {
+		const string& op = tokens.front();
+		unsigned value = 0;
+		size_t i = 0;
+		for (; i < op.length() && op[i] >= '0' && op[i] <= '9'; ++i)
+			value = value * 10 + (op[i] - '0');
+		if (i == 0 || i != op.length()) break;
+		bytes.push_back(value & 0xFF);
+		if (width == 2) bytes.push_back((value >> 8) & 0xFF); // little endian
+		tokens.pop();
+	}
+	if (bytes.empty()) return 0;
+
+	int len = bytes.length();
+	sections[currSection].writeBytes(locationCnt, bytesToHex((const unsigned char*)bytes.data(), len));
+	locationCnt += len;
+	sections[currSection].size += len;
+	return len / width;
+}
+
+// pads the current section up to a multiple of alignment; in code sections without an
+// explicit fill the padding is made of instructions without any effect
+void Assembler::alignSection(int alignment, int fill, int max){
+	Section& section = sections[currSection];
+	if (alignment > section.align) section.align = alignment;
+
+	int pad = (alignment - locationCnt % alignment) % alignment;
+	if (pad == 0) return;
+	bool nops = (section.code() && fill == -1);
+	if (nops)
+		while (pad == 1 || pad == 2 || pad == 5) pad += alignment; // can't be built from 3 and 4 byte nops
+	if (max != -1 && pad > max) return;
+
+	int start = locationCnt;
+	if (nops) {
+		int pairs = (pad % 3 == 0) ? 0 : ((pad % 3 == 1) ? 1 : 2);
+		for (int i = 0; i < pairs; ++i) {
+			section.writeBytes(locationCnt, instrOpCode[PUSH] + "20");	// push %r0
+			section.writeBytes(locationCnt + 2, instrOpCode[POP] + "20");	// pop %r0
+			noteCost(PUSH, 1, -1, locationCnt);
+			noteCost(POP, 1, -1, locationCnt + 2);
+			locationCnt += 4;
+		}
+		for (; locationCnt < start + pad; locationCnt += 3) {
+			section.writeBytes(locationCnt, instrOpCode[XCHG] + "2020");	// xchg %r0, %r0
+			noteCost(XCHG, 1, 1, locationCnt);
+		}
+	}
+	else {
+		if (fill <= 0) section.writeZeroBytes(start, pad);
+		else {
+			string fillByte = decToHex(fill & 0xFF, 1), bytes;
+			for (int i = 0; i < pad; ++i) bytes += fillByte;
+			section.writeBytes(start, bytes);
+		}
+		locationCnt += pad;
+	}
+	section.size += pad;
+
+	if (currSection == TEXT) {
+		if (alignPadEnd != start) alignPadStart = start;
+		alignPadEnd = locationCnt;
+		if (!flowEnds.empty() && flowEnds.back() == start) flowEnds.push_back(locationCnt); // padding is never executed
+	}
+}
+
+// end of the code of the current .text label, alignment padding behind it doesn't count
+int Assembler::codeEnd(){
+	return (alignPadEnd == locationCnt) ? alignPadStart : locationCnt;
+}
+
+void Assembler::directiveHandler(string dir, queue<string>& tokens, int& label){
     
     string byteStr;
 	int value = 0;
@@ -453,6 +945,8 @@ void Assembler::directiveHandler(string dir, queue<string>& tokens, string& labe
 		equ = helpEqu;	 
 		helpInt = 0;
 		bool neg = false, defined = true;
+		vector<pair<int, int>> pending; // undefined operands (id, sign)
+		vector<pair<int, int>> labels;  // symbol id, sign of the labels in the value
 		value = 0;
 		if (equ[helpInt] == '-') {
 			neg = true;
@@ -464,70 +958,58 @@ void Assembler::directiveHandler(string dir, queue<string>& tokens, string& labe
 
 			if (strspn(op.c_str(), "0123456789") == op.size()) 
 				value += (neg ? (0 - atoi(op.c_str())) : atoi(op.c_str()));
-			else if (symbolTable.find(op) != symbolTable.end()) {
-				Symbol* symbol = &(symbolTable.find(op)->second);
-				if (symbol->defined) value += (neg ? (0 - symbol->offset) : symbol->offset);
+			else if (symbolId(op) != -1) {
+				Symbol* symbol = &symbolTable[symbolId(op)];
+				if (symbol->defined) {
+					value += (neg ? (0 - symbol->offset) : symbol->offset);
+					if (symbol->symType != EQU) labels.push_back({ symbolId(op), (neg ? -1 : 1) });
+				}
 				else {
 					defined = false;
-					symbol->size++;
-					symbol->flink.push_back(forw_ref(-1, name, (neg ? -1 : 1)));
+					pending.push_back({ symbolId(op), (neg ? -1 : 1) });
 				}
 			}
 			else {
 				defined = false;
-				addSymbol(op, UND, 0, LOCAL, SYMBOL, 0, false);
-				symbolTable.find(op)->second.size++;
-				symbolTable.find(op)->second.flink.push_back(forw_ref(-1, name, (neg ? -1 : 1)));
+				int id = addSymbol(op, UND, 0, LOCAL, SYMBOL, 0, false);
+				pending.push_back({ id, (neg ? -1 : 1) });
 			}
 			op = "";
 			if (equ[helpInt++] == '-') neg = true;
 			else neg = false;
 		}
-		if (symbolTable.find(name) != symbolTable.end()) {
-			symbolTable.find(name)->second.section = currSection;
-			symbolTable.find(name)->second.offset = value;
-			updateSymbol(name, currSection, value, opType, defined);
-			for (int i = 0; defined && (i < symbolTable.find(name)->second.flink.size()); ++i) {
-				if (symbolTable.find(name)->second.flink[i].patch < 0) {
-					string equName = symbolTable.find(name)->second.flink[i].name;
-					int sign = symbolTable.find(name)->second.flink[i].equ_sign;
-					symbolTable.find(equName)->second.offset += sign * locationCnt;
-					if (--symbolTable.find(equName)->second.size)
-						symbolTable.find(equName)->second.defined = true;
-				}
-				else {
-					int j = 0, old_j = 0, offset = -1, relocIndex = 0;
-					string bytesStr = "";
-					while (j < relocations.size())
-						if (relocations[j++].name == name) {
-							offset = relocations[--j].offset;
-							relocIndex = j;
-							break;
-						}
-					if (offset == -1) {
-						cout << "Error - relocation.\n"; exit(3);
-					}
-					for (int i = 0, j = 0; i < sections[sectionCode[symbolTable.find(name)->second.section]].size; i++) {
-						if (j >= offset) break;
-						if (sections[sectionCode[symbolTable.find(name)->second.section]].content.find(i)
-							!= sections[sectionCode[symbolTable.find(name)->second.section]].content.end()) {
-							bytesStr = sections[sectionCode[symbolTable.find(name)->second.section]].content.find(i)->second;
-							old_j = j;
-							j += bytesStr.length() / 2;
-						}
-						else continue;
-					}
-					offset -= old_j;
-					string replacement = decToHex(locationCnt, 2);
-					bytesStr.replace(offset * 2, 4, replacement);
-					sections[sectionCode[symbolTable.find(name)->second.section]].content.find(old_j)->second = bytesStr;
-					relocations.erase(relocations.begin() + relocIndex);
-				}
-			}
+		int equId = symbolId(name);
+		bool known = (equId != -1);
+		if (!known) equId = addSymbol(name, UND, value, LOCAL, SYMBOL, 0, false);
+		equLabels[equId] = labels;
+		updateSymbol(equId, known ? currSection : UND, value, defined ? equType(equId) : SYMBOL, defined);
+		if (defined) resolveForwardRefs(equId);
+		symbolTable[equId].size = pending.size(); // operands still to come
+		for (auto& ref : pending)
+			addForwardRef(ref.first, -1, equId, ref.second);
+	}
 
+	if (dir == ".align" || dir == ".p2align"){
+		int args[3] = { 0, -1, -1 }; // alignment, fill, max
+		for (int i = 0; i < 3 && !tokens.empty(); ++i) {
+			if (!regex_match(tokens.front(), regex("([0-9]{1,9})"))) { // fits an int
+				cout << "Directive " << dir << " needs decimal operands." << endl;
+				exit(1);
+			}
+			args[i] = atoi(tokens.front().c_str());
+			tokens.pop();
 		}
-		else
-			addSymbol(name, UND, value, LOCAL, SYMBOL, 0, defined);
+		if (dir == ".p2align" && args[0] > 15) { // 1 << 15 is the largest alignment, as for .align
+			cout << "Directive .p2align needs an exponent up to 15." << endl;
+			exit(1);
+		}
+		int alignment = (dir == ".p2align") ? (1 << args[0]) : args[0];
+		if (alignment <= 0 || (alignment & (alignment - 1)) || alignment > 0x8000) {
+			cout << "Directive " << dir << " needs a power of two alignment." << endl;
+			exit(1);
+		}
+		alignSection(alignment, args[1], args[2]);
+		return;
 	}
 
 	if (dir == ".skip"){
@@ -538,213 +1020,298 @@ void Assembler::directiveHandler(string dir, queue<string>& tokens, string& labe
             exit(1);
         }
 		value = operandParser(op, helpInt, helpInt);
-        sections[sectionCode[currSection]].writeZeroBytes(locationCnt, value);
+        sections[currSection].writeZeroBytes(locationCnt, value);
 		
 		locationCnt += value;
-		sections[sectionCode[currSection]].size += value;
-		if (label != "" && symbolTable.find(label) != symbolTable.end()) {
-			symbolTable.find(label)->second.size = locationCnt - symbolTable.find(label)->second.offset;
-			label = "";
+		sections[currSection].size += value;
+		if (label != -1) {
+			symbolTable[label].size = locationCnt - symbolTable[label].offset;
+			label = -1;
+		}
+		return;
+	}
+
+	if (dir == ".incbin"){
+		if (sections[currSection].nobits) {
+			cout << "Error: .incbin directive in " << sections[currSection].name << " section." << endl;
+			exit(1);
+		}
+		if (tokens.empty()) {
+			cout << "Directive .incbin needs a file name." << endl;
+			exit(1);
+		}
+		string fileName = tokens.front();
+		tokens.pop();
+		if (fileName.length() >= 2 && fileName[0] == '"' && fileName[fileName.length() - 1] == '"')
+			fileName = fileName.substr(1, fileName.length() - 2);
+		long args[2] = { 0, -1 }; // offset, length
+		for (int i = 0; i < 2 && !tokens.empty(); ++i) {
+			if (!regex_match(tokens.front(), regex("([0-9]+)"))) {
+				cout << "Directive .incbin needs decimal operands." << endl;
+				exit(1);
+			}
+			args[i] = atol(tokens.front().c_str());
+			tokens.pop();
+		}
+		long offs = args[0], len = args[1];
+
+		ifstream bin(fileName, ios::binary);
+		if (!bin.is_open()) {
+			cout << "Error: can't open .incbin file " << fileName << "." << endl;
+			exit(1);
 		}
+		bin.seekg(0, ios::end);
+		long fileSize = bin.tellg();
+		if (offs > fileSize) offs = fileSize;
+		if (len < 0 || offs + len > fileSize) len = fileSize - offs;
+		if (len == 0) return;
+		string data(len, '\0');
+		bin.seekg(offs);
+		bin.read(&data[0], len);
+		if (bin.gcount() != len) {
+			cout << "Error: can't read " << len << " bytes of .incbin file " << fileName << "." << endl;
+			exit(1);
+		}
+
+		sections[currSection].writeBytes(locationCnt, bytesToHex((const unsigned char*)data.data(), len));
+		locationCnt += len;
+		sections[currSection].size += len;
 		return;
 	}
 
 	if (dir == ".byte"){
-        if (currSection == BSS) {
-            cout << "Error: .byte directive in .bss section." << endl;
+        if (sections[currSection].nobits) {
+            cout << "Error: .byte directive in " << sections[currSection].name << " section." << endl;
             exit(1);
         }
         while (!tokens.empty()){
+			if (writeNumbers(tokens, 1)) continue;
 			string op = tokens.front();  
 			tokens.pop();
 			if (regex_match(op, regex("([0-9]+)")))
 				value = operandParser(op, helpInt, helpInt);
-			else  value = setAbsReloc(op, locationCnt, -1);
+			else  value = setAbsReloc(symbolRef(op), locationCnt, -1);
 			//write byte
 			value &= 0xFF;
 			byteStr = decToHex(value, 1);
-			sections[sectionCode[currSection]].writeByte(locationCnt, byteStr);
+			sections[currSection].writeByte(locationCnt, byteStr);
 
 			locationCnt++;
-			sections[sectionCode[currSection]].size++;
+			sections[currSection].size++;
         }
 		return;
 	}
 	if (dir == ".word"){
-        if (currSection == BSS) {
-            cout << "Error: .word directive in .bss section." << endl;
+        if (sections[currSection].nobits) {
+            cout << "Error: .word directive in " << sections[currSection].name << " section." << endl;
             exit(1);
         }
 		while (!tokens.empty()) {
-
+			if (writeNumbers(tokens, 2)) continue;
 			string op = tokens.front();
 			tokens.pop();
 			if (regex_match(op, regex("([0-9]+)")))
 				value = operandParser(op, helpInt, helpInt);
-			else value = setAbsReloc(op, locationCnt, -2);
+			else value = setAbsReloc(symbolRef(op), locationCnt, -2);
 			//write word // little endian ordering
 			value &= 0xFFFF;
 			string byteStr1 = decToHex(value >> 8, 1);
 			string byteStr2 = decToHex(value & 0xFF, 1);
-			sections[sectionCode[currSection]].writeBytes(locationCnt, byteStr2 + byteStr1);
+			sections[currSection].writeBytes(locationCnt, byteStr2 + byteStr1);
 
 			locationCnt += 2;
-			sections[sectionCode[currSection]].size += 2;
+			sections[currSection].size += 2;
         }
 		return;
 	}
 }
 
-void Assembler::instructionHandler(string instr, queue<string>& tokens){
-	regex instruction{ "(halt|iret|ret|int|call|jmp|jeq|jne|jgt|push|pop|xchg|mov|add|sub|mul|div|cmp|not|and|or|xor|test|shl|shr)?" };
-	regex jmp_instruction{ "(int|call|jmp|jeq|jne|jgt)?" };
-	smatch match;
-	if(!regex_match(instr, match, instruction)){
-		cout << "Error - Non-existent instruction." << endl;
-        exit(1);
-	}
-	if(regex_match(instr, match, jmp_instruction)) jmpFlag = true;
-	else jmpFlag = false;
-
-	int numOfOper = instrNumOper[instrName[instr]];
-	string instrByteStr = instrOpCode[instrName[instr]], op1ByteStr, op2ByteStr;
-	int op1Byte, op2Byte;
-	int numOfBytes1 = 0, numOfBytes2 = 0; 
-	int regNum = -1, pcrel = 0, addend = 0;
-	
-	if (numOfOper == 0){
-		if(!tokens.empty()){
-			cout << "Error - Too many arguments." << endl;
-            exit(1);
-		}
-		sections[sectionCode[currSection]].writeByte(locationCnt, instrByteStr);
-		locationCnt++; // instructionDescriptor (OC_(4-0).S.Un.Un)
-		sections[sectionCode[currSection]].size++;
-		return;
-	}
+// front end of an instruction: checks and classifies the operands and adds a row
+// to the IR, the bytes are written later by encodeInstructions
+void Assembler::instructionHandler(string instr, queue<string>& tokens, int line){
+	Instruction op = instrName[instr];
+	jmpFlag = (op == INT || op == CALL || op == JMP || op == JEQ || op == JNE || op == JGT);
 
-	string op1 = tokens.front(), op2 = "";
-	tokens.pop();
-	int am1 = addressingMode(op1), am2 = 0;
-	int op1Val = operandParser(op1, numOfBytes1, regNum), op2Val = 0;
-	if (numOfOper == 2) {
+	int numOfOper = instrNumOper[op];
+	int row = code.add(op, line, locationCnt, currSection);
+	int am[2] = { -1, -1 }, costAm[2] = { -1, -1 };
+	for (int k = 0; k < numOfOper; ++k) {
 		if (tokens.empty()) {
 			cout << "Error - Too few arguments." << endl;
 			exit(1);
 		}
-		op2 = tokens.front();
+		string operand = tokens.front();
 		tokens.pop();
-		if (numOfBytes2 == 2 && numOfBytes1 == 2)
-			instrByteStr = decToHex((int)strtol(instrByteStr.c_str(), NULL, 16) | 4, 1);
-	}
-	
-	op1Byte = am1 << 5;
-	if (op1Val == -1) // symbol
-		op1Val = setAbsReloc(op1, locationCnt + 2, -(2 + ((numOfOper == 2) ? (1 + numOfBytes2) : 0)));
-	else if (op1Val == -2) {
-		pcrel = 1;
-		addend = -(2 + ((numOfOper == 2) ? (1 + numOfBytes2) : 0));
-		op1Val = setPCrelReloc(op1, locationCnt + 2, addend);
-	}
-
-	if(!numOfBytes1){
-		op1Byte |= regNum << 1;
-		if(toupper(op1[op1.length() - 1]) == 'H') op1Byte |= 1;
-		op1ByteStr = decToHex(op1Byte, 1);
-	} else if(numOfBytes1 == 1){ // immed decimal 
-		op1Byte <<= 8;
-		op1Byte |= (op1Val & 0xFF);
-		op1ByteStr = decToHex(op1Byte, 2);
-	} else if(numOfBytes1 == 2){
-		if(regNum > -1){
-			op1Byte |= regNum << 1;
-			op1Byte <<= 16;
-			op1Byte |= (op1Val & 0xFFFF); // decimal (symbol: undefined - 0 / defined - op1Val)
-			op1ByteStr = decToHex(op1Byte, 3);
-		} else { 
-			op1Byte <<= 16;
-			op1Byte |= (op1Val & 0xFFFF); // decimal (symbol: undefined - 0 / defined - op1Val)
-			op1ByteStr = decToHex(op1Byte, 3);
-		}
-	} else exit(2);
-
-	if (pcrel) {
-		string temp = decToHex((0x10000 + addend), 2);
-		op1ByteStr = op1ByteStr.substr(0, 2) + temp.substr(2, 2) + temp.substr(0, 2);
-	}
-
-	if (numOfOper == 1){
-		if(!tokens.empty()){
-			cout << "Error - Too many arguments." << endl;
-            exit(1);
+		am[k] = costAm[k] = addressingMode(operand);
+		if (jmpFlag && operand[0] != '*') costAm[k] = 0; // jump target given directly, no operand access
+
+		int width = 0, regNum = -1;
+		int value = operandParser(operand, width, regNum);
+		int desc = am[k] << 5;
+		if (width == 0) {
+			desc |= regNum << 1;
+			if (toupper(operand[operand.length() - 1]) == 'H') desc |= 1;
 		}
-		if((instrName[match[1]] != PUSH) && (am1 == 0)){
-			cout << "Error - Invalid addressing mode (immediate) for destination operand." << endl;
-			exit(1);
+		else if (width == 2 && regNum > -1) desc |= regNum << 1;
+
+		code.desc[k][row] = desc;
+		code.width[k][row] = width;
+		bool known = true; // every symbol of the operand is defined above it
+		if (value == -1 || value == -2) { // symbol
+			code.ref[k][row] = (value == -1) ? SYM_ABS : SYM_PCREL;
+			int id = symbolId(operand);
+			known = (id != -1 && symbolTable[id].defined);
+			code.value[k][row] = symbolRef(operand);
 		}
-
-		sections[sectionCode[currSection]].writeBytes(locationCnt, instrByteStr + op1ByteStr);
-		locationCnt += 2 + numOfBytes1; // 2 = (InstrDescr + Op1Descr)
-		sections[sectionCode[currSection]].size += 2 + numOfBytes1;
-		return;
+		else if (value == -3 || value == -4) { // expression
+			code.ref[k][row] = (value == -3) ? EXPR_ABS : EXPR_PCREL;
+			code.value[k][row] = code.exprs.size();
+			code.exprs.push_back(operand);
+			for (auto& name : exprNames(operand)) {
+				int id = symbolId(name);
+				if (id == -1 || !symbolTable[id].defined) known = false;
+				symbolRef(name);
+			}
+		}
+		else code.value[k][row] = value;
+		code.bigEndian[k][row] = known && value != -2 && value != -4;
 	}
-
-	regNum = -1; pcrel = 0; addend = 0;
-	am2 = addressingMode(op2);
-	op2Val = operandParser(op2, numOfBytes2, regNum);
-
-	if(!tokens.empty()){
+	if (!tokens.empty()) {
 		cout << "Error - Too many arguments." << endl;
 		exit(1);
 	}
-	if(((instrName[match[1]] != SHR) && (am2 == 0)) || ((instrName[match[1]] == SHR) && (am1 == 0))){
+	if ((numOfOper == 1 && op != PUSH && am[0] == 0)
+		|| (numOfOper == 2 && ((op != SHR && am[1] == 0) || (op == SHR && am[0] == 0)))) {
 		cout << "Error - Invalid addressing mode (immediate) for destination operand." << endl;
 		exit(1);
 	}
-	
-	op2Byte = am2 << 5;
-	if (op2Val == -1) // symbol
-		op2Val = setAbsReloc(op2, locationCnt + 3 + numOfBytes1, -2);
-	else if (op2Val == -2) {
-		pcrel = 1; 
-		addend = -2;
-		op2Val = setPCrelReloc(op2, locationCnt + 3 + numOfBytes1, addend);
-	}
-
-	if(!numOfBytes2){
-		op2Byte |= regNum << 1;
-		if(toupper(op2[op2.length() - 1]) == 'H') op2Byte |= 1;
-		op2ByteStr = decToHex(op2Byte, 1);
-	} else if(numOfBytes2 == 1){ // immed decimal
-		op2Byte <<= 8;
-		op2Byte |= (op2Val & 0xFF);
-		op2ByteStr = decToHex(op2Byte, 2);
-	} else if(numOfBytes2 == 2){
-		if(regNum > -1){
-			op2Byte |= regNum << 1;
-			op2Byte <<= 16;
-			op2Byte |= (op2Val & 0xFFFF); // decimal (symbol: undefined - 0 / defined - op2Val)
-			op2ByteStr = decToHex(op2Byte, 3);
-		} else { 
-			op2Byte <<= 16;
-			op2Byte |= (op2Val & 0xFFFF); // decimal (symbol: undefined - 0 / defined - op2Val)
-			op2ByteStr = decToHex(op2Byte, 3);
-		}
-	} else exit(2);
-
-	if (pcrel) {
-		string temp = decToHex((0x10000 + addend), 2);
-		op2ByteStr = op2ByteStr.substr(0, 2) + temp.substr(2, 2) + temp.substr(0, 2);
-	}
-
-	sections[sectionCode[currSection]].writeBytes(locationCnt, instrByteStr + op1ByteStr + op2ByteStr);
-	locationCnt += 3 + numOfBytes1 + numOfBytes2; // 3 = (InstrDescr + Op1Descr + Op2Descr)
-	sections[sectionCode[currSection]].size += 3 + numOfBytes1 + numOfBytes2;
 
+	int size = (numOfOper == 0) ? 1 : 1 + numOfOper + code.width[0][row] + code.width[1][row]; // InstrDescr + OpDescr + operands
+	code.numOper[row] = numOfOper;
+	code.size[row] = size;
+	noteCost(op, costAm[0], costAm[1], locationCnt);
+	locationCnt += size;
+	sections[currSection].size += size;
+}
+
+// back end: writes the bytes of every IR row, symbols are looked up and
+// relocations made here, when the value of every label is known
+void Assembler::encodeInstructions(int first, int last){
+	if (last == -1) last = code.rows();
+	if (first == last) return;
+	unsigned char opCode[SHR + 1];
+	for (auto& it : instrOpCode) opCode[it.first] = (unsigned char)strtol(it.second.c_str(), NULL, 16);
+
+	int section = currSection;
+	unsigned char bytes[7];
+	for (int row = first; row < last; ++row) {
+		currSection = code.section[row];
+		int offs = code.offset[row], n = 0, numOfOper = code.numOper[row], eliminated = relocsEliminated;
+		bytes[n++] = opCode[code.instr[row]];
+		for (int k = 0; k < numOfOper; ++k) {
+			int value = code.value[k][row], width = code.width[k][row];
+			int site = offs + n + 1;
+			// pc points behind the instruction when the operand is used
+			int addend = (k == 0) ? -(2 + ((numOfOper == 2) ? (1 + code.width[1][row]) : 0)) : -2;
+			bool bigEndian = code.bigEndian[k][row];
+			int relocs = relocations.size();
+			if (code.ref[k][row] == SYM_ABS && symbolTable[value].symType == EQU && equLabels.count(value)) {
+				// a label difference, computed again when the labels move
+				code.exprs.push_back(symbolName(value));
+				value = setAbsReloc(value, site, addend);
+				exprSites.push_back({ currSection, site, (int)code.exprs.size() - 1, value, bigEndian });
+			}
+			else if (code.ref[k][row] == SYM_ABS || code.ref[k][row] == SYM_PCREL)
+				value = (code.ref[k][row] == SYM_ABS) ? setAbsReloc(value, site, addend) : setPCrelReloc(value, site, addend);
+			else if (code.ref[k][row] != LITERAL) {
+				ExprValue expr = evalExpr(code.exprs[value], true);
+				int constant = (int)expr.constant;
+				if (expr.labels) exprSites.push_back({ currSection, site, value, constant, bigEndian });
+				if (expr.terms.empty()) value = constant;
+				else if (code.ref[k][row] == EXPR_ABS) value = setAbsReloc(expr.terms[0].first, site, addend) + constant;
+				else value = setPCrelReloc(expr.terms[0].first, site, addend + constant);
+			}
+			if ((int)relocations.size() > relocs) relocations.back().bigEndian = bigEndian;
+			bytes[n++] = code.desc[k][row];
+			if (width == 1) bytes[n++] = value & 0xFF;
+			else if (width == 2 && bigEndian) {
+				bytes[n++] = (value >> 8) & 0xFF;
+				bytes[n++] = value & 0xFF;
+			}
+			else if (width == 2) {
+				bytes[n++] = value & 0xFF;
+				bytes[n++] = (value >> 8) & 0xFF;
+			}
+		}
+		sections[currSection].writeBytes(offs, bytesToHex(bytes, n));
+		code.folded[row] = relocsEliminated - eliminated;
+	}
+	currSection = section;
+}
+
+// push %psw; add $1, <counter>; pop %psw - a word add (S bit set) with a 2-byte immediate,
+// the counter address is filled in by allocateCounters
+void Assembler::insertCounter(int label){
+	Section& text = sections[TEXT];
+	unsigned char add = (unsigned char)strtol(instrOpCode[ADD].c_str(), NULL, 16) | 0x04;
+	text.writeBytes(locationCnt, instrOpCode[PUSH] + "3E");
+	text.writeBytes(locationCnt + 2, bytesToHex(&add, 1) + "00000180" + "0000");
+	text.writeBytes(locationCnt + 9, instrOpCode[POP] + "3E");
+	noteCost(PUSH, 1, -1, locationCnt);
+	noteCost(ADD, 0, 4, locationCnt + 2);
+	noteCost(POP, 1, -1, locationCnt + 9);
+	counters.push_back({ locationCnt, (label != -1) ? symbolTable[label].name : -1 });
+	locationCnt += 11;
+	text.size += 11;
+}
+
+// word counters are appended to .bss (created if the source has none)
+void Assembler::allocateCounters(){
+	if (counters.empty()) return;
+	Section& bss = sections[BSS];
+	bss.used = true;
+	if (bss.symbol == -1) bss.symbol = symbolId(bss.name);
+	if (bss.symbol == -1) bss.symbol = addSymbol(bss.name, BSS, 0, LOCAL, SECTION, 0, true);
+	int bssId = bss.symbol;
+
+	Section& text = sections[TEXT];
+	int base = (bss.size + 1) & ~1;
+	if (bss.align < 2) bss.align = 2;
+	for (int i = 0; i < counters.size(); ++i) {
+		patchWord(text, counters[i].first + 7, base + 2 * i, true);
+		relocations.push_back(Reloc(bssId, TEXT, counters[i].first + 7, ABS, 0));
+		relocations.back().bigEndian = true; // a known value, like the immediate in front of it
+	}
+	// keep the relocations in section, offset order for the listing and the layout passes
+	stable_sort(relocations.begin(), relocations.end(), [](const Reloc& a, const Reloc& b) {
+		return a.section < b.section || (a.section == b.section && a.offset < b.offset); });
+	bss.size = base + 2 * counters.size();
+	symbolTable[bssId].size = bss.size;
+}
+
+void Assembler::writeCounters(){
+	if (counters.empty()) return;
+	int base = sections[BSS].size - 2 * counters.size();
+	outputFile << endl << "  #.counters" << endl;
+	for (int i = 0; i < counters.size(); ++i) {
+		outputFile << " " << setfill(' ') << setw(4) << right << dec << i;
+		outputFile << setfill(' ') << setw(6) << hex << base + 2 * i;
+		if (counters[i].first == -1) outputFile << "  removed";
+		else outputFile << setfill(' ') << setw(6) << counters[i].first;
+		outputFile << "  " << ((counters[i].second != -1) ? &strTab[counters[i].second] : "-") << endl;
+	}
+}
+
+void Assembler::noteCost(Instruction instr, int am1, int am2, int offs){
+	if (!options.annotateCost || currSection != TEXT) return;
+	costs[offs] = instrCost[instr] + ((am1 != -1) ? modeCost[am1] : 0) + ((am2 != -1) ? modeCost[am2] : 0);
 }
 
 int Assembler::addressingMode(string operand){
     smatch match;
+	string expr;
+	int exprReg, exprMode = exprOperand(operand, expr, exprReg);
+	if (exprMode != -1) return exprMode;
 
 	if(jmpFlag){
 		if (regex_match(operand, match, opTypeRgx[jmp_op_dec]) 
@@ -784,6 +1351,18 @@ int Assembler::addressingMode(string operand){
 int Assembler::operandParser(string& operand, int& numOfBytes, int& reg){
 	smatch match;
 
+	// expression - a constant is a literal, anything else is evaluated by the back end
+	string expr;
+	int exprMode = exprOperand(operand, expr, reg);
+	if (exprMode != -1) {
+		ExprValue value = evalExpr(expr, false);
+		bool small = exprMode == 0 || (jmpFlag && exprMode == 4 && operand[0] != '*');
+		numOfBytes = (small && value.known && value.constant >= 0 && value.constant <= 0xFF) ? 1 : 2;
+		if (value.known && value.constant >= 0) return (int)value.constant;
+		operand = expr;
+		return (reg == 7) ? -4 : -3; // EXPR_PCREL : EXPR_ABS
+	}
+
 	if(jmpFlag){
 		// memdir
 		if (regex_match(operand, match, opTypeRgx[jmp_op_dec])){
@@ -902,48 +1481,113 @@ int Assembler::operandParser(string& operand, int& numOfBytes, int& reg){
 	return 0;
 }
 
-int Assembler::setAbsReloc(string symbolStr, int offset, int addend){
-	
-	auto symbol = symbolTable.find(symbolStr);
-																				
-	if (symbol == symbolTable.end()) { 
-		addSymbol(symbolStr, UND, 0, LOCAL, SYMBOL, 0, false);
-		symbolTable.find(symbolStr)->second.flink.push_back(forw_ref(offset));
-		relocations.push_back(Reloc(symbolStr, sectionCode[currSection], offset, ABS, addend));
-	}
-	else { 
-		if (symbol->second.defined) {
-			relocations.push_back(Reloc(symbolStr, sectionCode[currSection], offset, ABS, addend));
-			return symbolTable.find(symbolStr)->second.offset;
-		}
-		else {
-			relocations.push_back(Reloc(symbolStr, sectionCode[currSection], offset, ABS, addend));
-			symbolTable.find(symbolStr)->second.flink.push_back(forw_ref(offset));
+// symbol id of a referenced name, an undefined symbol is added on first use
+int Assembler::symbolRef(const string& label){
+	int id = symbolId(label);
+	return (id != -1) ? id : addSymbol(label, UND, 0, LOCAL, SYMBOL, 0, false);
+}
+
+// only values built from literals, other constants and label differences (end - start, the labels
+// of every section cancel out, as in reduceExpr) can be folded into the code
+TokenType Assembler::equType(int id){
+	map<int, int> sums;
+	for (auto& label : equLabels[id]) sums[symbolTable[label.first].section] += label.second;
+	if (equLabels[id].empty()) equLabels.erase(id); // the labels are kept for the layout passes
+	for (auto& sum : sums)
+		if (sum.second != 0) return SYMBOL;
+	return EQU;
+}
+
+// returns the value written in place
+int Assembler::setAbsReloc(int id, int offset, int addend){
+	Symbol& symbol = symbolTable[id];
+	if (symbol.defined) {
+		if (symbol.symType == EQU) { // constant, nothing to relocate
+			relocsEliminated++;
+			return symbol.offset;
 		}
+		relocations.push_back(Reloc(id, currSection, offset, ABS, addend));
+		return (symbol.scope == GLOBAL) ? 0 : symbol.offset; // global - relative to the symbol itself
 	}
-	
+	relocations.push_back(Reloc(id, currSection, offset, ABS, addend));
+	addForwardRef(id, relocations.size() - 1);
 	return 0;
 }
 
-int Assembler::setPCrelReloc(string symbolStr, int offset, int addend){
-	
-	auto symbol = symbolTable.find(symbolStr);
-
-	if(symbol == symbolTable.end()){
-		addSymbol(symbolStr, UND, 0, LOCAL, SYMBOL, 0, false);
-		symbolTable.find(symbolStr)->second.flink.push_back(forw_ref(offset));
-		relocations.push_back(Reloc(symbolStr, sectionCode[currSection], offset, PCREL, addend));
-	} 
+// returns the value of the displacement field
+int Assembler::setPCrelReloc(int id, int offset, int addend){
+	Symbol& symbol = symbolTable[id];
+	if (symbol.defined) {
+		if (symbol.scope == LOCAL && symbol.section == currSection && symbol.symType != EQU) {
+			relocsEliminated++; // same section - displacement is already known
+			fixups.push_back(Reloc(id, currSection, offset, PCREL, addend));
+			return symbol.offset + addend - offset;
+		}
+		relocations.push_back(Reloc(id, currSection, offset, PCREL, addend));
+		if (symbol.scope == LOCAL) return symbol.offset + addend;
+	}
 	else {
-		if(symbol->second.defined){ 
-			relocations.push_back(Reloc(symbolStr, sectionCode[currSection], offset, PCREL, addend));
-			return symbolTable.find(symbolStr)->second.offset;
+		relocations.push_back(Reloc(id, currSection, offset, PCREL, addend));
+		addForwardRef(id, relocations.size() - 1);
+	}
+	return addend;
+}
+
+// patches every forward reference to a symbol that just got its value
+void Assembler::resolveForwardRefs(int id){
+
+	Symbol& symbol = symbolTable[id];
+	int ref = symbol.flink;
+	symbol.flink = -1;
+
+	for (; ref != -1; ref = refPool[ref].next) {
+		forw_ref& fr = refPool[ref];
+		if (fr.reloc < 0) { //equ
+			Symbol& equ = symbolTable[fr.equ];
+			equ.offset += fr.equ_sign * symbol.offset;
+			if (symbol.symType != EQU) equLabels[fr.equ].push_back({ id, fr.equ_sign });
+			if (--equ.size == 0) {
+				equ.defined = true;
+				equ.symType = equType(fr.equ);
+				noteDefined(fr.equ);
+				resolveForwardRefs(fr.equ);
+			}
+			continue;
 		}
-		else {
-			relocations.push_back(Reloc(symbolStr, sectionCode[currSection], offset, PCREL, addend));
-			symbolTable.find(symbolStr)->second.flink.push_back(forw_ref(offset));
+		if (symbol.scope == GLOBAL) continue;
+
+		Reloc& reloc = relocations[fr.reloc];
+		Section& section = sections[reloc.section];
+
+		if (reloc.type == PCREL && reloc.section == symbol.section && symbol.symType != EQU) {
+			patchWord(section, reloc.offset, symbol.offset + reloc.addend - reloc.offset);
+			fixups.push_back(reloc);
+			reloc.symbol = -1; // dropped, see compile()
+			relocsEliminated++;
+		}
+		else if (reloc.type == ABS && symbol.symType == EQU) {
+			patchWord(section, reloc.offset, symbol.offset);
+			reloc.symbol = -1;
+			relocsEliminated++;
 		}
+		else if (reloc.type == PCREL)
+			patchWord(section, reloc.offset, symbol.offset + reloc.addend);
+		else
+			patchWord(section, reloc.offset, symbol.offset);
 	}
-	
-	return 0;
+}
+
+// value of the (at most) two bytes at offset, little endian unless bigEndian
+int Assembler::readWord(Section& section, int offset, bool bigEndian){
+	string bytes = section.readBytes(offset, 2);
+	if (bytes.empty()) return 0;
+	if (bigEndian) return (int)strtol(bytes.c_str(), NULL, 16);
+	int value = (int)strtol(bytes.substr(0, 2).c_str(), NULL, 16);
+	if (bytes.length() == 4) value |= (int)strtol(bytes.substr(2, 2).c_str(), NULL, 16) << 8;
+	return value;
+}
+
+void Assembler::patchWord(Section& section, int offset, int value, bool bigEndian){
+	string word = decToHex(value & 0xFFFF, 2);
+	section.patchBytes(offset, bigEndian ? word : word.substr(2, 2) + word.substr(0, 2));
 }
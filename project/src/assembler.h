@@ -4,64 +4,224 @@
 #include <vector>
 #include <queue>
 #include <unordered_map>
+#include <unordered_set>
 #include <fstream>
 #include <sstream>
 #include <regex>
+#include <memory>
+#include <functional>
+#include <cstdio>
 
 #include "section.h"
 #include "symbol.h"
 #include "reloc.h"
+#include "ir.h"
 
 using namespace std;
 
+class InputPipe;
+class WorkerPool;
+
 enum Instruction { HALT, IRET, RET, INT, CALL, JMP, JEQ, JNE, JGT, PUSH, POP, XCHG, 
                     MOV, ADD, SUB, MUL, DIV, CMP, NOT, AND, OR, XOR, TEST, SHL, SHR };
 enum OperandType { op_dec, op_sym_val, op_reg_ind, op_sym_mem, op_mem, op_reg, op_reg_ind_val, op_reg_ind_sym, op_pcrel,
                     jmp_op_dec, jmp_op_sym_val, jmp_op_reg_ind, jmp_op_sym_mem, jmp_op_mem, jmp_op_reg, jmp_op_reg_ind_val, jmp_op_reg_ind_sym, jmp_op_pcrel };
 
+struct AsmOptions {
+    string layoutProfile;       // --layout-profile=<file>, per label execution counts
+    bool gcFunctions = false;   // --gc-functions, drop code that can't be reached
+    string entry;               // --entry=<label>, gc root besides the global symbols
+    bool annotateCost = false;  // --annotate-cost, estimated cycles in the .text listing
+    bool instrument = false;    // --instrument, execution counter for every basic block
+    bool watch = false;         // --watch, keeps the state for reassemble()
+    map<string, int> defines;   // -D<name>[=<value>], for .if/.ifdef
+    bool hashIndex = false;     // --hash-index, hashed lookup table of the global symbols
+    bool mergeRodata = false;   // --merge-rodata, identical .rodata objects are kept once
+    int threads = 0;            // --threads=<n>, front end workers (0 - one per core)
+    size_t memoryBudget = 0;    // --memory=<MB>, streaming: the input is compiled block by block,
+                                // section bytes and relocations go to temporary files (0 - off)
+};
+
+// value of an operand expression: constant + sum of coefficient * symbol
+struct ExprValue {
+    long long constant = 0;
+    vector<pair<int, int>> terms;   // symbol id, coefficient
+    bool known = true;              // front end: every term is a constant already
+    bool labels = false;            // label differences were folded into constant
+};
+
+// operand whose value has label differences folded in, recomputed when labels move
+struct ExprSite {
+    int section, offset;            // site of the operand bytes
+    int expr;                       // CodeIR::exprs index
+    int constant;                   // value folded in so far
+    bool bigEndian;                 // CodeIR::bigEndian of the operand
+};
+
+// --watch: state at the start of every asmInput row
+struct LineState {
+    int offset;             // location counter
+    int symbols;            // symbols known so far
+    int label;              // last .text label
+    int code;               // first IR row of the line
+    unsigned char section;  // section id
+    unsigned char kind;     // TokenType of the first token
+};
+
+// rows of one piece of the source: the front end workers find the lines, the rows
+// are tokenized only once .if has been evaluated and they aren't skipped
+struct LexedChunk {
+    vector<pair<const char*, const char*>> spans;   // lines with a token: start, end
+    vector<int> lines;                  // line number inside the chunk
+    vector<bool> guarded;               // starts with .if/.else/.endif, looked at in skipped blocks
+    int lineCount = 0;
+    vector<queue<string>> rows;         // filled in by lexRows
+    vector<pair<unsigned char, unsigned char>> kinds;   // TokenType of the first token and of the statement
+    vector<size_t> hashes;              // --watch
+};
+
 class Assembler{
 public:
 
-    Assembler(ifstream& in, ofstream& out);
+    Assembler(istream& in, ostream& out, const AsmOptions& opt = AsmOptions());
     ~Assembler();
 
     void compile();
+    bool reassemble(ifstream& in);
+    void writeListing();
+    int eliminatedRelocs() const { return relocsEliminated; }
 
 private:
 
     int locationCnt;
-    ofstream& outputFile;
+    int relocsEliminated;
+    int alignPadStart, alignPadEnd;         // trailing alignment padding in .text
+    ostream& outputFile;
+    AsmOptions options;
     vector<queue<string>> asmInput;
+    vector<int> inputLines;                 // source line of every asmInput row
+    vector<pair<unsigned char, unsigned char>> rowKind; // TokenType of the first token and of the one behind a label
+    vector<size_t> rowHash;                 // --watch: hash of the source line of every row
+    map<string, int> constants;             // .if: -D definitions and constant .equ values read so far
+    unordered_set<string> parsedNames;      // .ifdef: labels and .equ symbols read so far
+    bool conditionals;                      // the input uses .if/.ifdef
+    vector<LineState> lineState;            // --watch
+    unique_ptr<InputPipe> reader;           // input blocks not read yet
+    unique_ptr<WorkerPool> lexPool;         // front end workers, kept from block to block
+    vector<pair<bool, bool>> conds;         // open .if blocks: lines are kept, a branch was taken
+    int lineNum;                            // lines in the blocks read so far
+    int currRow;                            // asmInput row in compile()
+    vector<int> definedRow;                 // --watch: row that gave every symbol its value (INT_MAX - none)
+    bool inputEnd;                          // .end was read
 
-    static map<SectionType, string> sectionCode;
     static map<Instruction, int> instrNumOper;
     static map<string, Instruction> instrName;
     static map<Instruction, string> instrOpCode;
     static map<OperandType, regex> opTypeRgx;
-
-	vector<string> symbols;
-    map<string, Symbol> symbolTable;
-    unordered_map<string, Section> sections;
+    static map<Instruction, int> instrCost;
+    static int modeCost[5];
+
+    vector<Symbol> symbolTable;            // indexed by symbol id (serial number)
+    unordered_map<string, int> symbolIndex; // label -> symbol id
+    vector<char> strTab;                    // labels, '\0' terminated
+    vector<forw_ref> refPool;               // forward references, linked through forw_ref::next
+    vector<Section> sections;               // indexed by section id, SectionType ones first
+    unordered_map<string, int> sectionIndex; // section name -> id, looked up by .section only
     vector<Reloc> relocations;
-
-    SectionType currSection;
+    unordered_map<int, vector<pair<int, int>>> equLabels; // .equ symbol -> symbol id, sign of the labels in its value
+    vector<Reloc> fixups;                   // pc relative references resolved at assembly time
+    vector<ExprSite> exprSites;             // operands with folded label differences
+    CodeIR code;                            // instructions, encoded after the front end is done
+    vector<int> flowEnds;                   // .text offsets right after an unconditional jump/return
+    vector<FILE*> relocSpill;               // --memory: resolved relocations of every section, by offset
+    vector<bool> encodedRefs;               // --memory: symbols referenced by instructions already encoded
+    map<int, int> costs;                    // .text offset -> estimated cycles of the instruction there
+    vector<pair<int, int>> counters;        // --instrument: .text offset of the counted block, label (strTab index)
+
+    int currSection;
     TokenType currToken;
     bool jmpFlag;
 
-    void parseInput(ifstream& in);
-
-    void addSymbol(string, SectionType, int, ScopeType, TokenType, int, bool);
-	void updateSymbol(string, SectionType, int, TokenType, bool);
+    void parseInput(istream& in);
+    bool readBlock();
+    bool streamBlock(int&);
+    void flushStream();
+    size_t residentBytes();
+    void spillRelocations(const vector<int>&);
+    int lexWorkers(size_t);
+    size_t lexBlockSize();
+    void lexParallel(int, const function<void(int)>&);
+    void lexInput(const string&, LexedChunk&);
+    void lexChunk(const char*, const char*, LexedChunk&);
+    void lexRows(LexedChunk&, int, int);
+    void lexRange(LexedChunk&, int, int);
+    static size_t lineHash(const char*, size_t);
+    void conditionalHandler(queue<string>, vector<pair<bool, bool>>&);
+    bool evalCondition(const string&);
+    int evalSum(const string&);
+    void noteConstant(const queue<string>&);
+    void writeCodeBytes(Section&, bool);
+    void writeDataBytes(Section&);
+    void writeRelocations(int);
+    int openSection(const string&, queue<string>&);
+    string alignNote(Section&);
+    void writeCosts();
+    void writeCounters();
+
+    // hashindex.cpp
+    static uint32_t gnuHash(const char*);
+    void writeHashIndex();
+
+    int addSymbol(string, int, int, ScopeType, TokenType, int, bool);
+	void updateSymbol(int, int, int, TokenType, bool);
+    int symbolId(const string&);
+    const char* symbolName(int);
+    void addForwardRef(int, int, int = -1, int = 1);
     TokenType tokenParser(string);
-    void directiveHandler(string, queue<string>&, string&);
-    void instructionHandler(string, queue<string>&);
+    void directiveHandler(string, queue<string>&, int&);
+    void alignSection(int, int, int);
+    int codeEnd();
+    int writeNumbers(queue<string>&, int);
+    void instructionHandler(string, queue<string>&, int);
+    void encodeInstructions(int = 0, int = -1);
     int addressingMode(string);
     int operandParser(string&, int&, int&);
-
-    int setAbsReloc(string, int, int);
-    int setPCrelReloc(string, int, int);
+    void noteCost(Instruction, int, int, int);
+    void insertCounter(int);
+    void allocateCounters();
+
+    int symbolRef(const string&);
+    int setAbsReloc(int, int, int);
+    int setPCrelReloc(int, int, int);
+    void resolveForwardRefs(int);
+    TokenType equType(int);
+    void noteDefined(int);
+    void patchWord(Section&, int, int, bool = false);
+    int readWord(Section&, int, bool = false);
 
     string decToHex(int, int);
+
+    // expr.cpp
+    int exprOperand(const string&, string&, int&);
+    static vector<string> exprNames(const string&);
+    ExprValue evalExpr(const string&, bool);
+    ExprValue parseExpr(const string&, size_t&, int, bool);
+    ExprValue parsePrimary(const string&, size_t&, bool);
+    void reduceExpr(ExprValue&);
+    void refoldExprs();
+
+    // layout.cpp
+    bool endsFlow(Instruction, const string&);
+    vector<pair<int, int>> textUnits();
+    void reorderText();
+    int readProfile(const string&, const vector<pair<int, int>>&, vector<long long>&);
+    int placeUnits(const vector<pair<int, int>>&, const vector<int>&, vector<Segment>&, vector<pair<int, int>>&);
+    void gcFunctions();
+    void mergeRodata();
+    int newOffset(const vector<Segment>&, int);
+    void rearrangeSection(int, const vector<Segment>&, int, const unordered_set<int>& = unordered_set<int>());
+    void textLabels(int, vector<int>&, int = 0);
+    static string bytesToHex(const unsigned char*, int);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,242 @@
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include "assembler.h"
+
+// operand expressions: decimal (or 0x) numbers, symbols, parentheses, unary + -
+// and the binary | & << >> + - * / (lowest to highest precedence). Constants and
+// differences of labels of one section are folded at assembly time, what is left
+// has to be one symbol plus a constant and becomes a relocation
+
+static const char* exprOperators = "+-*/<>&|()";
+static const char* exprChars = "+-*/<>&|()_0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+// $<expr>, <expr>, <expr>(%r<num>), <expr>(%pc) and, for jumps, *<expr> and *<expr>(%r<num>);
+// returns the addressing mode, -1 when the operand isn't an expression (a plain literal or
+// symbol). reg is the register of <expr>(%r<num>), 7 for pc relative
+int Assembler::exprOperand(const string& operand, string& expr, int& reg){
+	static const regex indexed{ "(.+)\\((%r([0-7])|%pc)\\)" };
+	string body = operand;
+	int mode = 4;   // mem, memdir for jumps
+	bool star = jmpFlag && !body.empty() && body[0] == '*';
+	reg = -1;
+	if (star) body = body.substr(1);
+	else if (!jmpFlag && !body.empty() && body[0] == '$') {
+		body = body.substr(1);
+		mode = 0;
+	}
+	smatch match;
+	if (mode != 0 && (star || !jmpFlag) && regex_match(body, match, indexed)) {
+		reg = (match[2] == "%pc") ? 7 : stoi(match[3]);
+		body = match[1];
+		mode = 3;
+	}
+	if (body.find_first_of(exprOperators) == string::npos || body.find_first_not_of(exprChars) != string::npos) return -1;
+	expr = body;
+	return mode;
+}
+
+// symbol names in an expression, in order
+vector<string> Assembler::exprNames(const string& expr){
+	vector<string> names;
+	for (size_t pos = 0; pos < expr.length(); ) {
+		if (!isalnum(expr[pos]) && expr[pos] != '_') {
+			pos++;
+			continue;
+		}
+		size_t end = pos;
+		while (end < expr.length() && (isalnum(expr[end]) || expr[end] == '_')) end++;
+		if (!isdigit(expr[pos])) names.push_back(expr.substr(pos, end - pos));
+		pos = end;
+	}
+	return names;
+}
+
+// final == false (front end): labels may not be known yet, known tells whether the
+// value is a constant already. final == true (encoder): the result is a constant, or
+// one term with coefficient 1 (the relocated symbol) plus a constant
+ExprValue Assembler::evalExpr(const string& expr, bool final){
+	size_t pos = 0;
+	ExprValue value = parseExpr(expr, pos, 1, final);
+	if (pos != expr.length()) {
+		cout << "Error - Invalid expression " << expr << "." << endl;
+		exit(1);
+	}
+	if (!final) return value;
+
+	reduceExpr(value);
+	if (value.terms.empty()) return value;
+	int sum = 0, rep = -1;
+	bool oneSection = true;
+	for (auto& term : value.terms) {
+		Symbol& symbol = symbolTable[term.first];
+		Symbol& first = symbolTable[value.terms[0].first];
+		if (value.terms.size() > 1 && !(symbol.defined && first.defined && symbol.section == first.section)) oneSection = false;
+		sum += term.second;
+		if (rep == -1 && term.second > 0) rep = term.first;
+	}
+	if (!oneSection || sum != 1) {
+		cout << "Error - Expression " << expr << " is not relocatable." << endl;
+		exit(1);
+	}
+	if (value.terms.size() > 1) { // a + b - c: b - c is folded, a is relocated
+		for (auto& term : value.terms) value.constant += (long long)term.second * symbolTable[term.first].offset;
+		value.constant -= symbolTable[rep].offset;
+		value.labels = true;
+	}
+	value.terms.assign(1, { rep, 1 });
+	return value;
+}
+
+ExprValue Assembler::parseExpr(const string& expr, size_t& pos, int minPrec, bool final){
+	ExprValue left = parsePrimary(expr, pos, final);
+	while (pos < expr.length() && expr[pos] != ')') {
+		string op = expr.substr(pos, (expr.compare(pos, 2, "<<") == 0 || expr.compare(pos, 2, ">>") == 0) ? 2 : 1);
+		int prec = (op == "|") ? 1 : (op == "&") ? 2 : (op == "<<" || op == ">>") ? 3 : (op == "+" || op == "-") ? 4
+			: (op == "*" || op == "/") ? 5 : 0;
+		if (prec == 0) {
+			cout << "Error - Invalid expression " << expr << "." << endl;
+			exit(1);
+		}
+		if (prec < minPrec) break;
+		pos += op.length();
+		ExprValue right = parseExpr(expr, pos, prec + 1, final);
+
+		if (!left.known || !right.known) {
+			left.known = false;
+			continue;
+		}
+		left.labels |= right.labels;
+		if (op == "+" || op == "-") {
+			int sign = (op == "+") ? 1 : -1;
+			left.constant += sign * right.constant;
+			for (auto& term : right.terms) left.terms.push_back({ term.first, sign * term.second });
+			continue;
+		}
+		// everything else needs constants, label differences are folded first
+		reduceExpr(left);
+		reduceExpr(right);
+		if (op == "*" && (left.terms.empty() || right.terms.empty())) {
+			if (left.terms.empty()) swap(left, right);
+			for (auto& term : left.terms) term.second *= right.constant;
+			left.constant *= right.constant;
+			left.labels |= right.labels;
+			continue;
+		}
+		if (!left.terms.empty() || !right.terms.empty()) {
+			cout << "Error - Operands of " << op << " in " << expr << " are not constants." << endl;
+			exit(1);
+		}
+		if (op == "/" && right.constant == 0) {
+			cout << "Error - Division by zero in " << expr << "." << endl;
+			exit(1);
+		}
+		if (op == "*") left.constant *= right.constant;
+		else if (op == "/") left.constant /= right.constant;
+		else if (op == "<<") left.constant <<= right.constant;
+		else if (op == ">>") left.constant >>= right.constant;
+		else if (op == "&") left.constant &= right.constant;
+		else left.constant |= right.constant;
+	}
+	return left;
+}
+
+ExprValue Assembler::parsePrimary(const string& expr, size_t& pos, bool final){
+	ExprValue value;
+	if (pos >= expr.length()) {
+		cout << "Error - Missing operand in " << expr << "." << endl;
+		exit(1);
+	}
+	char c = expr[pos];
+	if (c == '(') {
+		value = parseExpr(expr, ++pos, 1, final);
+		if (pos >= expr.length() || expr[pos] != ')') {
+			cout << "Error - Missing ) in " << expr << "." << endl;
+			exit(1);
+		}
+		pos++;
+	}
+	else if (c == '-' || c == '+') {
+		value = parsePrimary(expr, ++pos, final);
+		if (c == '-') {
+			value.constant = -value.constant;
+			for (auto& term : value.terms) term.second = -term.second;
+		}
+	}
+	else if (isdigit(c)) {
+		bool hex = expr.compare(pos, 2, "0x") == 0 || expr.compare(pos, 2, "0X") == 0;
+		char* end;
+		value.constant = strtoll(expr.c_str() + pos, &end, hex ? 16 : 10);
+		pos = end - expr.c_str();
+	}
+	else if (isalpha(c) || c == '_') {
+		size_t end = pos;
+		while (end < expr.length() && (isalnum(expr[end]) || expr[end] == '_')) end++;
+		string name = expr.substr(pos, end - pos);
+		pos = end;
+		int id = symbolId(name);
+		if (id != -1 && symbolTable[id].defined && symbolTable[id].symType == EQU) {
+			value.constant = symbolTable[id].offset;
+			if (equLabels.count(id)) { // .equ of a label difference, can change with the layout
+				value.labels = true;
+				if (!final) value.known = false;
+			}
+		}
+		else if (!final) value.known = false;
+		else if (id == -1) {
+			cout << "Error - Symbol " << name << " in " << expr << " is not defined." << endl;
+			exit(1);
+		}
+		else value.terms.push_back({ id, 1 });
+	}
+	else {
+		cout << "Error - Invalid expression " << expr << "." << endl;
+		exit(1);
+	}
+	return value;
+}
+
+// terms of one symbol are merged; defined labels of one section whose coefficients
+// add up to 0 (a difference) are replaced by their value
+void Assembler::reduceExpr(ExprValue& value){
+	vector<pair<int, int>> merged;
+	for (auto& term : value.terms) {
+		auto same = find_if(merged.begin(), merged.end(), [&term](const pair<int, int>& t) { return t.first == term.first; });
+		if (same == merged.end()) merged.push_back(term);
+		else same->second += term.second;
+	}
+	merged.erase(remove_if(merged.begin(), merged.end(), [](const pair<int, int>& t) { return t.second == 0; }), merged.end());
+
+	vector<pair<int, int>> kept;
+	for (auto& term : merged) {
+		Symbol& symbol = symbolTable[term.first];
+		if (!symbol.defined) {
+			kept.push_back(term);
+			continue;
+		}
+		int sum = 0;
+		for (auto& other : merged)
+			if (symbolTable[other.first].defined && symbolTable[other.first].section == symbol.section) sum += other.second;
+		if (sum != 0) kept.push_back(term);
+		else {
+			value.constant += (long long)term.second * symbol.offset;
+			value.labels = true;
+		}
+	}
+	value.terms.swap(kept);
+}
+
+// after labels moved (layout passes, --watch): operands with label differences are computed
+// again, the bytes (and the addend of a pc relative reference) get the change
+void Assembler::refoldExprs(){
+	for (auto& site : exprSites) {
+		int constant = (int)evalExpr(code.exprs[site.expr], true).constant, delta = constant - site.constant;
+		if (delta == 0) continue;
+		Section& section = sections[site.section];
+		patchWord(section, site.offset, readWord(section, site.offset, site.bigEndian) + delta, site.bigEndian);
+		for (auto* list : { &relocations, &fixups })
+			for (auto& reloc : *list)
+				if (reloc.section == site.section && reloc.offset == site.offset && reloc.type == PCREL) reloc.addend += delta;
+		site.constant = constant;
+	}
+}
@@ -0,0 +1,431 @@
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "fileio.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_LINKED_FILE    // linked requests may use the file an openat in the same link made
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+static const int prefetchDepth = 16;    // sources read ahead of the assembler
+static const size_t firstRead = 1 << 16; // io_uring: buffer of the first read of a file
+
+// ordinary system calls on a few worker threads
+class ThreadIO : public FileIO {
+public:
+    explicit ThreadIO(int workers = 4);
+    ~ThreadIO();
+    void prefetch(const vector<string>& paths) override;
+    bool read(int index, string& content) override;
+    void write(const string& path, string content) override;
+    bool finish() override;
+    const char* name() const override { return "threads"; }
+
+private:
+    void work();
+    void schedule(int upTo);
+    bool readFile(const string& path, string& content);
+    bool writeFile(const string& path, const string& content);
+
+    mutex lock;
+    condition_variable wake, ready;
+    deque<function<void()>> jobs;
+    vector<string> paths, contents;
+    vector<int> state;          // 0 - not read yet, 1 - read, -1 - failed
+    int scheduled = 0, writes = 0;
+    bool failed = false, stop = false;
+    vector<thread> pool;
+};
+
+ThreadIO::ThreadIO(int workers){
+    for (int i = 0; i < workers; ++i) pool.emplace_back(&ThreadIO::work, this);
+}
+
+ThreadIO::~ThreadIO(){
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto& worker : pool) worker.join();
+}
+
+void ThreadIO::work(){
+    while (true) {
+        function<void()> job;
+        {
+            unique_lock<mutex> guard(lock);
+            wake.wait(guard, [this] { return stop || !jobs.empty(); });
+            if (jobs.empty()) return;
+            job = move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+// read jobs for the paths before upTo, the lock is held
+void ThreadIO::schedule(int upTo){
+    for (; scheduled < upTo && scheduled < (int)paths.size(); ++scheduled) {
+        int index = scheduled;
+        jobs.push_back([this, index] {
+            string content;
+            bool ok = readFile(paths[index], content);
+            lock_guard<mutex> guard(lock);
+            contents[index] = move(content);
+            state[index] = ok ? 1 : -1;
+            ready.notify_all();
+        });
+    }
+    wake.notify_all();
+}
+
+void ThreadIO::prefetch(const vector<string>& _paths){
+    lock_guard<mutex> guard(lock);
+    paths = _paths;
+    contents.assign(paths.size(), string());
+    state.assign(paths.size(), 0);
+    schedule(prefetchDepth);
+}
+
+bool ThreadIO::read(int index, string& content){
+    unique_lock<mutex> guard(lock);
+    schedule(index + 1 + prefetchDepth);
+    ready.wait(guard, [this, index] { return state[index] != 0; });
+    content = move(contents[index]);
+    return state[index] == 1;
+}
+
+void ThreadIO::write(const string& path, string content){
+    auto bytes = make_shared<string>(move(content));
+    lock_guard<mutex> guard(lock);
+    writes++;
+    jobs.push_back([this, path, bytes] {
+        bool ok = writeFile(path, *bytes);
+        lock_guard<mutex> guard(lock);
+        failed |= !ok;
+        writes--;
+        ready.notify_all();
+    });
+    wake.notify_one();
+}
+
+bool ThreadIO::finish(){
+    unique_lock<mutex> guard(lock);
+    ready.wait(guard, [this] { return writes == 0; });
+    return !failed;
+}
+
+bool ThreadIO::readFile(const string& path, string& content){
+    struct stat st;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    syscalls++;
+    if (fd < 0) return false;
+    bool ok = fstat(fd, &st) == 0;
+    syscalls++;
+    content.resize(ok ? st.st_size : 0);
+    for (size_t done = 0; ok && done < content.size(); ) {
+        ssize_t n = ::read(fd, &content[done], content.size() - done);
+        syscalls++;
+        if (n <= 0) content.resize(done);  // the file got shorter
+        else done += n;
+        ok = n >= 0;
+    }
+    close(fd);
+    syscalls++;
+    return ok;
+}
+
+bool ThreadIO::writeFile(const string& path, const string& content){
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    syscalls++;
+    if (fd < 0) return false;
+    bool ok = true;
+    for (size_t done = 0; ok && done < content.size(); ) {
+        ssize_t n = ::write(fd, content.data() + done, content.size() - done);
+        syscalls++;
+        ok = n > 0;
+        if (ok) done += n;
+    }
+    ok &= close(fd) == 0;
+    syscalls++;
+    return ok;
+}
+
+#ifdef HAVE_IO_URING
+// every file is one link of openat (into a registered file slot) -> read or write -> close,
+// the links of many files go to the kernel in one io_uring_enter. A read that fills its
+// buffer goes on with another link and a buffer twice as big
+class UringIO : public FileIO {
+public:
+    UringIO();
+    ~UringIO();
+    bool ok() const { return ring >= 0; }
+    void prefetch(const vector<string>& paths) override;
+    bool read(int index, string& content) override;
+    void write(const string& path, string content) override;
+    bool finish() override;
+    const char* name() const override { return "io_uring"; }
+
+private:
+    struct Request {
+        string path;
+        string data;                // read: the content, write: the bytes to write
+        size_t offset = 0;          // next byte to read or write
+        bool writing = false;
+        int slot = -1, pending = 0; // registered file, completions still to come
+        int openResult = 0, ioResult = 0;
+        int state = 0;              // 0 - in progress, 1 - done, -1 - failed
+    };
+    static const int slots = 32;
+
+    io_uring_sqe* nextSqe(int request, int stage);
+    void startQueued();
+    void submit(bool wait);
+    void complete(int request);
+
+    int ring = -1;
+    unsigned *sqTail, *sqMask, *sqArray, *cqHead, *cqTail, *cqMask;
+    io_uring_sqe* sqes;
+    io_uring_cqe* cqes;
+    void *sqMap = MAP_FAILED, *cqMap = MAP_FAILED, *sqeMap = MAP_FAILED;
+    size_t sqMapSize = 0, cqMapSize = 0, sqeMapSize = 0;
+    unsigned toSubmit = 0;
+
+    deque<Request> requests;        // the reads first, then the writes
+    deque<int> queued;              // requests waiting for a file slot
+    vector<int> freeSlots;
+    int scheduled = 0, reads = 0, writesLeft = 0;
+    bool failed = false;
+};
+
+UringIO::UringIO(){
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, 4 * slots, &params);
+    syscalls++;
+    if (fd < 0) return;
+    if (!(params.features & IORING_FEAT_LINKED_FILE) || !(params.features & IORING_FEAT_NODROP)) {
+        close(fd);
+        return;
+    }
+
+    // openat, read, write and close have to be there
+    vector<char> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = (io_uring_probe*)buffer.data();
+    bool supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    syscalls++;
+    for (int op : { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE })
+        supported = supported && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    vector<int> files(slots, -1);
+    supported = supported && syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, files.data(), slots) == 0;
+    syscalls++;
+
+    sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) sqMapSize = cqMapSize = max(sqMapSize, cqMapSize);
+    sqeMapSize = params.sq_entries * sizeof(io_uring_sqe);
+    if (supported) {
+        sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cqMap = (params.features & IORING_FEAT_SINGLE_MMAP) ? sqMap
+            : mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqeMap = mmap(nullptr, sqeMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        syscalls += (cqMap == sqMap) ? 2 : 3;
+    }
+    if (!supported || sqMap == MAP_FAILED || cqMap == MAP_FAILED || sqeMap == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    char* sq = (char*)sqMap;
+    char* cq = (char*)cqMap;
+    sqTail = (unsigned*)(sq + params.sq_off.tail);
+    sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned*)(sq + params.sq_off.array);
+    cqHead = (unsigned*)(cq + params.cq_off.head);
+    cqTail = (unsigned*)(cq + params.cq_off.tail);
+    cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    sqes = (io_uring_sqe*)sqeMap;
+    cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    for (int slot = slots - 1; slot >= 0; --slot) freeSlots.push_back(slot);
+    ring = fd;
+}
+
+UringIO::~UringIO(){
+    if (ring < 0) {
+        if (sqeMap != MAP_FAILED) munmap(sqeMap, sqeMapSize);
+        if (cqMap != MAP_FAILED && cqMap != sqMap) munmap(cqMap, cqMapSize);
+        if (sqMap != MAP_FAILED) munmap(sqMap, sqMapSize);
+        return;
+    }
+    while (freeSlots.size() < slots) submit(true); // the kernel still uses the buffers
+    munmap(sqeMap, sqeMapSize);
+    if (cqMap != sqMap) munmap(cqMap, cqMapSize);
+    munmap(sqMap, sqMapSize);
+    close(ring);
+}
+
+io_uring_sqe* UringIO::nextSqe(int request, int stage){
+    unsigned tail = *sqTail, index = tail & *sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = ((unsigned long long)request << 2) | stage;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    toSubmit++;
+    return sqe;
+}
+
+// links for the queued requests, as long as there are free slots
+void UringIO::startQueued(){
+    while (!queued.empty() && !freeSlots.empty()) {
+        int id = queued.front();
+        queued.pop_front();
+        Request& r = requests[id];
+        r.slot = freeSlots.back();
+        freeSlots.pop_back();
+        r.pending = 3;
+        r.openResult = r.ioResult = 0;
+        if (!r.writing) r.data.resize(r.offset + max(r.offset, firstRead));
+
+        io_uring_sqe* sqe = nextSqe(id, 0);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long long)r.path.c_str();
+        sqe->open_flags = r.writing ? (O_WRONLY | O_CREAT | ((r.offset == 0) ? O_TRUNC : 0)) : O_RDONLY;
+        sqe->len = 0644;
+        sqe->file_index = r.slot + 1;
+        sqe->flags = IOSQE_IO_LINK;     // a failed open cancels the rest
+
+        sqe = nextSqe(id, 1);
+        sqe->opcode = r.writing ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = r.slot;
+        sqe->addr = (unsigned long long)&r.data[r.offset];
+        sqe->len = r.data.size() - r.offset;
+        sqe->off = r.offset;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK; // the file is closed after a short read too
+
+        sqe = nextSqe(id, 2);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = r.slot + 1;
+    }
+}
+
+// hands the new entries to the kernel and takes the completions, wait - at least one
+void UringIO::submit(bool wait){
+    int n;
+    do {
+        n = syscall(__NR_io_uring_enter, ring, toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        syscalls++;
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        cout << "Error - io_uring_enter: " << strerror(errno) << endl;
+        exit(1);
+    }
+    toSubmit -= n;
+
+    unsigned head = *cqHead, tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        io_uring_cqe& cqe = cqes[head & *cqMask];
+        int id = cqe.user_data >> 2, stage = cqe.user_data & 3;
+        Request& r = requests[id];
+        if (stage == 0) r.openResult = cqe.res;
+        else if (stage == 1) r.ioResult = cqe.res;
+        if (--r.pending == 0) complete(id);
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+void UringIO::complete(int id){
+    Request& r = requests[id];
+    freeSlots.push_back(r.slot);
+    bool ok = r.openResult >= 0 && r.ioResult >= 0 && (!r.writing || r.ioResult > 0 || r.offset == r.data.size());
+    if (ok) r.offset += r.ioResult;
+    // a read that filled the buffer may have more to read, a short write has more to write
+    if (ok && (r.writing ? r.offset < r.data.size() : r.offset == r.data.size())) {
+        queued.push_back(id);
+        return;
+    }
+    r.state = ok ? 1 : -1;
+    if (!r.writing) r.data.resize(ok ? r.offset : 0);
+    else {
+        string().swap(r.data);
+        failed |= !ok;
+        writesLeft--;
+    }
+}
+
+void UringIO::prefetch(const vector<string>& paths){
+    for (auto& path : paths) {
+        requests.push_back(Request());
+        requests.back().path = path;
+    }
+    reads = paths.size();
+}
+
+bool UringIO::read(int index, string& content){
+    for (; scheduled < reads && scheduled <= index + prefetchDepth; ++scheduled) queued.push_back(scheduled);
+    startQueued();
+    while (requests[index].state == 0) {
+        submit(true);
+        startQueued();
+    }
+    if (toSubmit) submit(false);    // the next sources are read while this one is assembled
+    content = move(requests[index].data);
+    return requests[index].state == 1;
+}
+
+void UringIO::write(const string& path, string content){
+    requests.push_back(Request());
+    Request& r = requests.back();
+    r.path = path;
+    r.data = move(content);
+    r.writing = true;
+    writesLeft++;
+    queued.push_back(requests.size() - 1);
+    startQueued();  // submitted with the next read
+}
+
+bool UringIO::finish(){
+    while (writesLeft > 0) {
+        startQueued();
+        submit(true);
+    }
+    return !failed;
+}
+#endif
+
+bool FileIO::uringSupported(){
+#ifdef HAVE_IO_URING
+    return UringIO().ok();
+#else
+    return false;
+#endif
+}
+
+FileIO* FileIO::create(const string& kind){
+#ifdef HAVE_IO_URING
+    if (kind != "threads") {
+        UringIO* io = new UringIO();
+        if (io->ok()) return io;
+        delete io;
+    }
+#endif
+    return new ThreadIO();
+}
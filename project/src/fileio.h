@@ -0,0 +1,32 @@
+#ifndef _FILEIO_H_
+#define _FILEIO_H_
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+using namespace std;
+
+// --batch: sources are read ahead of the assembler and objects are written
+// behind it. With io_uring the open/read/close of many files go to the kernel
+// in a few system calls; without it a small thread pool makes ordinary calls
+class FileIO {
+public:
+    virtual ~FileIO() {}
+    virtual void prefetch(const vector<string>& paths) = 0;     // files read() will ask for, in that order
+    virtual bool read(int index, string& content) = 0;          // waits for paths[index], false if it can't be read
+    virtual void write(const string& path, string content) = 0; // returns at once
+    virtual bool finish() = 0;                                   // waits for the writes, false if one failed
+    virtual const char* name() const = 0;
+
+    long long systemCalls() const { return syscalls; }
+
+    // "uring", "threads" or "" - io_uring when the kernel has it
+    static FileIO* create(const string& kind = "");
+    static bool uringSupported();
+
+protected:
+    atomic<long long> syscalls{ 0 };
+};
+
+#endif
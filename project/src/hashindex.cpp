@@ -0,0 +1,53 @@
+#include <iomanip>
+#include <algorithm>
+#include "assembler.h"
+
+uint32_t Assembler::gnuHash(const char* name){
+	uint32_t h = 5381;
+	for (; *name; ++name) h = h * 33 + (unsigned char)*name;
+	return h;
+}
+
+// --hash-index: lookup table over the defined global symbols, in the spirit of
+// .gnu.hash. A consumer hashes the name (gnuHash), tests the two bloom filter bits
+// and walks the chain from buckets[h % nbucket]: entries with the same hash (lowest
+// bit ignored) are compared by name, an entry with the lowest bit set ends the chain.
+void Assembler::writeHashIndex(){
+	vector<pair<uint32_t, int>> entries; // hash, symbol id
+	for (int i = 0; i < symbolTable.size(); ++i)
+		if (symbolTable[i].scope == GLOBAL && symbolTable[i].defined) entries.push_back({ gnuHash(symbolName(i)), i });
+
+	uint32_t nbucket = entries.size() / 2 + 1;
+	stable_sort(entries.begin(), entries.end(), [nbucket](const pair<uint32_t, int>& a, const pair<uint32_t, int>& b) {
+		return a.first % nbucket < b.first % nbucket; });
+
+	// the second bit is taken above the bits that pick the word and the first bit, as .gnu.hash does
+	uint32_t nbloom = 1;
+	int shift = 5;
+	while (nbloom * 32 < entries.size() * 2) {
+		nbloom <<= 1;
+		shift++;
+	}
+	vector<uint32_t> bloom(nbloom, 0);
+	vector<int> buckets(nbucket, -1);
+	for (int k = 0; k < entries.size(); ++k) {
+		uint32_t h = entries[k].first;
+		bloom[(h / 32) % nbloom] |= (1u << (h % 32)) | (1u << ((h >> shift) % 32));
+		if (buckets[h % nbucket] == -1) buckets[h % nbucket] = k;
+	}
+
+	outputFile << endl << "  #.hash" << endl;
+	outputFile << " " << dec << entries.size() << " " << nbucket << " " << nbloom << " " << shift
+		<< "    (symbols, buckets, bloom words, bloom shift)" << endl;
+	outputFile << " bloom:";
+	for (uint32_t word : bloom) outputFile << " " << setfill('0') << setw(8) << right << hex << word;
+	outputFile << endl << " buckets:" << dec;
+	for (int bucket : buckets) outputFile << " " << bucket;
+	outputFile << endl << " chain:" << endl;
+	for (int k = 0; k < entries.size(); ++k) {
+		uint32_t h = entries[k].first & ~1u;
+		if (k + 1 == entries.size() || entries[k + 1].first % nbucket != entries[k].first % nbucket) h |= 1;
+		outputFile << "  " << setfill('0') << setw(8) << hex << h << setfill(' ') << setw(6) << entries[k].second
+			<< "  " << symbolName(entries[k].second) << endl;
+	}
+}
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "fileio.h"
+
+using namespace std;
+
+// benchmark of the --batch file I/O: make bench, then
+// ./iobench [--files=<n>] [--size=<bytes>]   (default: 2000 sources of 2000 bytes)
+// every source is read and written back as <name>.o, once per backend:
+//   streams   - ifstream/ofstream per file, as a single assembly does it
+//   threads   - FileIO thread pool
+//   io_uring  - FileIO with io_uring (skipped when the kernel doesn't have it)
+// system calls of the backends are counted by FileIO; for streams they are the read and
+// write calls from /proc/self/io plus an open and a close per file
+
+static long long readWriteCalls(){
+    ifstream io("/proc/self/io");
+    string key;
+    long long value, calls = 0;
+    while (io >> key >> value)
+        if (key == "syscr:" || key == "syscw:") calls += value;
+    return calls;
+}
+
+static void report(const char* name, int files, double seconds, long long calls){
+    cout << "  " << setw(10) << left << name << right << fixed << setprecision(0) << setw(10) << files / seconds
+        << " files/s" << setprecision(2) << setw(8) << (double)calls / files << " calls/file" << endl;
+}
+
+int main(int argc, char* argv[]){
+    int files = 2000, size = 2000;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--files=", 8) == 0) files = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--size=", 7) == 0) size = atoi(argv[i] + 7);
+    }
+    char dir[] = "/tmp/iobench.XXXXXX";
+    if (files < 1 || size < 0 || mkdtemp(dir) == nullptr) {
+        cout << "Error - Invalid arguments." << endl;
+        return 1;
+    }
+
+    string text;
+    while (text.size() < (size_t)size) text += "\tmov $1, %r2\n";
+    text.resize(size);
+    vector<string> sources, objects;
+    for (int i = 0; i < files; ++i) {
+        sources.push_back(string(dir) + "/s" + to_string(i) + ".s");
+        objects.push_back(string(dir) + "/s" + to_string(i) + ".o");
+        ofstream(sources.back(), ios::binary) << text;
+    }
+    cout << files << " files of " << size << " bytes, io_uring "
+        << (FileIO::uringSupported() ? "available" : "not available") << endl;
+
+    long long before = readWriteCalls();
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < files; ++i) {
+        ifstream in(sources[i]);
+        string source((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        ofstream(objects[i]) << source;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    report("streams", files, seconds, readWriteCalls() - before + 4LL * files);
+
+    for (const char* kind : { "threads", "uring" }) {
+        FileIO* io = FileIO::create(kind);
+        if (string(kind) == "uring" && string(io->name()) != "io_uring") {
+            delete io;
+            continue;
+        }
+        start = chrono::steady_clock::now();
+        io->prefetch(sources);
+        for (int i = 0; i < files; ++i) {
+            string source;
+            if (!io->read(i, source) || source != text) {
+                cout << "Error - " << io->name() << " read " << sources[i] << " wrong." << endl;
+                return 1;
+            }
+            io->write(objects[i], move(source));
+        }
+        bool ok = io->finish();
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (!ok) {
+            cout << "Error - " << io->name() << " writes failed." << endl;
+            return 1;
+        }
+        report(io->name(), files, seconds, io->systemCalls());
+        delete io;
+    }
+
+    for (int i = 0; i < files; ++i) {
+        unlink(sources[i].c_str());
+        unlink(objects[i].c_str());
+    }
+    rmdir(dir);
+    return 0;
+}
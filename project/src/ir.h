@@ -0,0 +1,110 @@
+#ifndef _IR_H_
+#define _IR_H_
+
+#include <vector>
+#include <string>
+
+using namespace std;
+
+enum OperandRef { LITERAL, SYM_ABS, SYM_PCREL, EXPR_ABS, EXPR_PCREL };
+
+// instructions of the code sections kept as columns (struct of arrays), one row per instruction;
+// filled by the front end (Assembler::instructionHandler) once the operands are parsed,
+// turned into bytes by Assembler::encodeInstructions when all labels are known
+struct CodeIR {
+    vector<unsigned char> instr;        // Instruction
+    vector<unsigned char> numOper;
+    vector<unsigned char> desc[2];      // operand descriptor: am << 5 | reg << 1 | high byte
+    vector<unsigned char> width[2];     // bytes behind the descriptor: 0, 1 or 2
+    vector<unsigned char> ref[2];       // OperandRef
+    vector<int> value[2];               // literal value, symbol id or exprs index
+    vector<unsigned char> bigEndian[2]; // two byte field written high byte first: literals and values of
+                                        // symbols defined before the row; forward and pc relative ones are
+                                        // little endian, as forward references have always been patched
+    vector<int> line;                   // source line
+    vector<unsigned char> size;
+    vector<int> offset;                 // offset in the section
+    vector<unsigned char> section;      // section id, .text or another code ("x") section
+    vector<unsigned char> folded;       // references resolved at assembly time (set by the encoder)
+    vector<string> exprs;               // operand expressions, kept when rows are spliced
+
+    int rows() const { return (int)instr.size(); }
+
+    int add(unsigned char _instr, int _line, int _offset, unsigned char _section){
+        instr.push_back(_instr);
+        numOper.push_back(0);
+        for (int k = 0; k < 2; ++k) {
+            desc[k].push_back(0);
+            width[k].push_back(0);
+            ref[k].push_back(LITERAL);
+            value[k].push_back(0);
+            bigEndian[k].push_back(0);
+        }
+        line.push_back(_line);
+        size.push_back(1);
+        offset.push_back(_offset);
+        section.push_back(_section);
+        folded.push_back(0);
+        return rows() - 1;
+    }
+
+    // rows [at, at + removed) are replaced by the rows from first to the end
+    void splice(int at, int removed, int first){
+        spliceColumn(instr, at, removed, first);
+        spliceColumn(numOper, at, removed, first);
+        for (int k = 0; k < 2; ++k) {
+            spliceColumn(desc[k], at, removed, first);
+            spliceColumn(width[k], at, removed, first);
+            spliceColumn(ref[k], at, removed, first);
+            spliceColumn(value[k], at, removed, first);
+            spliceColumn(bigEndian[k], at, removed, first);
+        }
+        spliceColumn(line, at, removed, first);
+        spliceColumn(size, at, removed, first);
+        spliceColumn(offset, at, removed, first);
+        spliceColumn(section, at, removed, first);
+        spliceColumn(folded, at, removed, first);
+    }
+
+    // --memory: only the rows marked in keep stay, with their expressions
+    void retain(const vector<bool>& keep){
+        vector<string> kept;
+        for (int row = 0; row < rows(); ++row)
+            for (int k = 0; k < 2; ++k)
+                if (keep[row] && ref[k][row] >= EXPR_ABS) {
+                    kept.push_back(move(exprs[value[k][row]]));
+                    value[k][row] = (int)kept.size() - 1;
+                }
+        exprs.swap(kept);
+        retainColumn(instr, keep);
+        retainColumn(numOper, keep);
+        for (int k = 0; k < 2; ++k) {
+            retainColumn(desc[k], keep);
+            retainColumn(width[k], keep);
+            retainColumn(ref[k], keep);
+            retainColumn(value[k], keep);
+            retainColumn(bigEndian[k], keep);
+        }
+        retainColumn(line, keep);
+        retainColumn(size, keep);
+        retainColumn(offset, keep);
+        retainColumn(section, keep);
+        retainColumn(folded, keep);
+    }
+
+private:
+    template<class T> static void retainColumn(vector<T>& column, const vector<bool>& keep){
+        int to = 0;
+        for (int row = 0; row < (int)column.size(); ++row)
+            if (keep[row]) column[to++] = column[row];
+        column.resize(to);
+    }
+    template<class T> static void spliceColumn(vector<T>& column, int at, int removed, int first){
+        vector<T> moved(column.begin() + first, column.end());
+        column.resize(first);
+        column.erase(column.begin() + at, column.begin() + at + removed);
+        column.insert(column.begin() + at, moved.begin(), moved.end());
+    }
+};
+
+#endif
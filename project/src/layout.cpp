@@ -0,0 +1,439 @@
+#include <iomanip>
+#include <algorithm>
+#include "assembler.h"
+
+// code behind an unconditional jump or return can only be reached through a label
+bool Assembler::endsFlow(Instruction instr, const string& dst){
+	if (instr == HALT || instr == IRET || instr == RET || instr == JMP) return true;
+	if (dst != "%pc" && dst != "%r7") return false;
+	return instr == POP || (instrNumOper[instr] == 2 && instr != CMP && instr != TEST);
+}
+
+// splits .text into [start, end) units that can be moved as a whole: a new unit
+// starts at a label only when the code in front of it can't fall through into it
+vector<pair<int, int>> Assembler::textUnits(){
+	vector<pair<int, int>> units;
+	Section& text = sections[TEXT];
+	if (!text.used || text.size == 0) return units;
+	int size = text.size;
+
+	vector<int> labels;
+	for (auto& symbol : symbolTable)
+		if (symbol.section == TEXT && symbol.symType == LABEL && symbol.defined) labels.push_back(symbol.offset);
+	sort(labels.begin(), labels.end());
+	sort(flowEnds.begin(), flowEnds.end());
+
+	int begin = 0;
+	for (int offs : labels) {
+		if (offs <= begin || offs >= size) continue;
+		if (binary_search(flowEnds.begin(), flowEnds.end(), offs)) {
+			units.push_back({ begin, offs });
+			begin = offs;
+		}
+	}
+	units.push_back({ begin, size });
+	return units;
+}
+
+// profile lines: "<label> <count>" (or "<label>: <count>") with execution counts
+// of labels, or "0x<offset> <count>" with samples taken at .text offsets (emulator);
+// '#' starts a comment. Counts are summed per unit, returns the number of lines used.
+int Assembler::readProfile(const string& fileName, const vector<pair<int, int>>& units, vector<long long>& counts){
+	ifstream profile(fileName);
+	if (!profile.is_open()) {
+		cout << "Error opening layout profile " << fileName << "." << endl;
+		exit(2);
+	}
+	int matched = 0;
+	string line;
+	while (getline(profile, line)) {
+		line = line.substr(0, line.find('#'));
+		istringstream fields(line);
+		string key;
+		long long count;
+		if (!(fields >> key >> count)) continue;
+		if (key[key.length() - 1] == ':') key.erase(key.length() - 1);
+
+		int offs;
+		if (key.compare(0, 2, "0x") == 0) offs = (int)strtol(key.c_str(), NULL, 16);
+		else {
+			int id = symbolId(key);
+			if (id == -1 || symbolTable[id].section != TEXT || symbolTable[id].symType != LABEL) continue;
+			offs = symbolTable[id].offset;
+		}
+		auto unit = upper_bound(units.begin(), units.end(), make_pair(offs, INT32_MAX));
+		if (unit == units.begin() || offs >= (--unit)->second) continue;
+		counts[unit - units.begin()] += count;
+		matched++;
+	}
+	return matched;
+}
+
+// --layout-profile: hot functions are packed at the start of .text in order of
+// their execution counts, functions that never ran are moved to the end
+void Assembler::reorderText(){
+	vector<pair<int, int>> units = textUnits();
+	vector<long long> counts(units.size(), 0);
+	int matched = readProfile(options.layoutProfile, units, counts);
+	if (units.size() < 2) return;
+
+	// execution starts at the entry unit (the start of .text or --entry), it goes first;
+	// a last unit that falls off the end stays last
+	int entry = 0, id = options.entry.empty() ? -1 : symbolId(options.entry);
+	if (id != -1 && symbolTable[id].defined && symbolTable[id].section == TEXT)
+		entry = upper_bound(units.begin(), units.end(), make_pair(symbolTable[id].offset, INT32_MAX)) - units.begin() - 1;
+	bool pinLast = !binary_search(flowEnds.begin(), flowEnds.end(), units.back().second);
+	if (pinLast && entry == units.size() - 1) entry = -1; // it can't be moved in front
+
+	vector<int> order;
+	if (entry != -1) order.push_back(entry);
+	for (int i = 0; i < units.size(); ++i)
+		if (i != entry) order.push_back(i);
+	auto first = order.begin() + (entry != -1 ? 1 : 0), last = order.end() - (pinLast ? 1 : 0);
+	if (first < last)
+		stable_sort(first, last, [&counts](int a, int b) { return counts[a] > counts[b]; });
+
+	vector<Segment> segments;
+	vector<pair<int, int>> gaps;
+	int size = placeUnits(units, order, segments, gaps);
+	int moved = 0;
+	for (auto& segment : segments)
+		if (segment.newStart != segment.oldStart) moved++;
+
+	if (moved) {
+		rearrangeSection(TEXT, segments, size);
+		for (auto& gap : gaps) sections[TEXT].writeZeroBytes(gap.first, gap.second);
+	}
+	cout << "Layout profile: " << matched << " entries used, " << moved << " of " << units.size()
+		<< " functions moved in .text." << endl;
+}
+
+// .text labels a symbol stands for: itself, or the labels an .equ is computed from
+void Assembler::textLabels(int id, vector<int>& labels, int depth){
+	Symbol& symbol = symbolTable[id];
+	if (symbol.symType == LABEL) {
+		if (symbol.section == TEXT && symbol.defined) labels.push_back(id);
+		return;
+	}
+	auto equ = equLabels.find(id);
+	if (equ == equLabels.end() || depth > 8) return;
+	for (auto& label : equ->second) textLabels(label.first, labels, depth + 1);
+}
+
+// lays the units out one after another in the given order, every unit keeps its
+// offset modulo the section alignment so .align inside it still holds; returns the new size
+int Assembler::placeUnits(const vector<pair<int, int>>& units, const vector<int>& order,
+	vector<Segment>& segments, vector<pair<int, int>>& gaps){
+	int align = sections[TEXT].align;
+	int pos = 0;
+	for (int i : order) {
+		int gap = ((units[i].first - pos) % align + align) % align;
+		if (gap) gaps.push_back({ pos, gap });
+		pos += gap;
+		segments.push_back({ units[i].first, units[i].second - units[i].first, pos, true });
+		pos += units[i].second - units[i].first;
+	}
+	return pos;
+}
+
+// --gc-functions: units of .text that can't be reached from the entry point, a global
+// symbol or another section are removed. Edges are the relocations, folded pc relative
+// references and label differences inside a unit, a unit that falls through into the next one keeps it alive.
+void Assembler::gcFunctions(){
+	vector<pair<int, int>> units = textUnits();
+	if (units.empty()) return;
+	auto unitOf = [&units](int offs) {
+		auto unit = upper_bound(units.begin(), units.end(), make_pair(offs, INT32_MAX));
+		return (unit == units.begin() || offs >= (--unit)->second) ? -1 : (int)(unit - units.begin());
+	};
+
+	vector<int> work;
+	vector<bool> live(units.size(), false);
+	auto mark = [&](int unit) {
+		if (unit != -1 && !live[unit]) {
+			live[unit] = true;
+			work.push_back(unit);
+		}
+	};
+	if (options.entry.empty()) mark(0); // execution starts at the beginning of .text
+	else {
+		int id = symbolId(options.entry);
+		if (id == -1 || !symbolTable[id].defined || symbolTable[id].section != TEXT) {
+			cout << "Entry point " << options.entry << " is not defined in .text." << endl;
+			exit(1);
+		}
+		mark(unitOf(symbolTable[id].offset));
+	}
+	// a reference from outside .text keeps the labels alive, an .equ the labels it is computed from
+	vector<vector<int>> edges(units.size());
+	auto reach = [&](int section, int offs, int id) {
+		vector<int> labels;
+		textLabels(id, labels);
+		int from = (section == TEXT) ? unitOf(offs) : -1;
+		for (int label : labels) {
+			int offs = symbolTable[label].offset;
+			int to = (unitOf(offs) != -1 || offs == 0) ? unitOf(offs) : unitOf(offs - 1); // a label at the end of .text
+			if (section != TEXT) mark(to);
+			else if (from != -1 && to != -1) edges[from].push_back(to);
+		}
+	};
+	for (int i = 0; i < symbolTable.size(); ++i)
+		if (symbolTable[i].scope == GLOBAL && symbolTable[i].defined) reach(-1, 0, i); // exported
+	for (auto* list : { &relocations, &fixups })
+		for (auto& reloc : *list) reach(reloc.section, reloc.offset, reloc.symbol);
+	for (auto& site : exprSites) // labels folded into an operand
+		for (auto& name : exprNames(code.exprs[site.expr]))
+			if (symbolId(name) != -1) reach(site.section, site.offset, symbolId(name));
+	for (int i = 0; i + 1 < units.size(); ++i)
+		if (!binary_search(flowEnds.begin(), flowEnds.end(), units[i].second)) edges[i].push_back(i + 1);
+	while (!work.empty()) {
+		int unit = work.back();
+		work.pop_back();
+		for (int to : edges[unit]) mark(to);
+	}
+
+	vector<int> order;
+	for (int i = 0; i < units.size(); ++i)
+		if (live[i]) order.push_back(i);
+	int oldSize = units.back().second;
+	if (order.size() == units.size()) {
+		cout << "Garbage collection: 0 of " << units.size() << " functions removed from .text." << endl;
+		return;
+	}
+
+	vector<Segment> segments;
+	vector<pair<int, int>> gaps;
+	int size = placeUnits(units, order, segments, gaps);
+	for (int i = 0; i < units.size(); ++i)
+		if (!live[i]) segments.push_back({ units[i].first, units[i].second - units[i].first, -1, false });
+	rearrangeSection(TEXT, segments, size);
+	for (auto& gap : gaps) sections[TEXT].writeZeroBytes(gap.first, gap.second);
+
+	// labels of removed code are dropped from the symbol table
+	vector<int> newId(symbolTable.size(), -1);
+	vector<Symbol> symbols;
+	for (int i = 0; i < symbolTable.size(); ++i) {
+		Symbol& symbol = symbolTable[i];
+		if (symbol.section == TEXT && symbol.symType == LABEL && !symbol.defined) {
+			symbolIndex.erase(symbolName(i));
+			continue;
+		}
+		newId[i] = symbols.size();
+		symbols.push_back(symbol);
+	}
+	for (auto& entry : symbolIndex) entry.second = newId[entry.second];
+	unordered_map<int, vector<pair<int, int>>> equs;
+	for (auto& equ : equLabels) {
+		vector<pair<int, int>>& labels = equs[newId[equ.first]];
+		for (auto& label : equ.second)
+			if (newId[label.first] != -1) labels.push_back({ newId[label.first], label.second });
+	}
+	equLabels.swap(equs);
+	for (auto& reloc : relocations) reloc.symbol = newId[reloc.symbol];
+	for (auto& fixup : fixups) fixup.symbol = newId[fixup.symbol];
+	for (auto& section : sections)
+		if (section.symbol != -1) section.symbol = newId[section.symbol];
+	symbolTable.swap(symbols);
+
+	cout << "Garbage collection: " << units.size() - order.size() << " of " << units.size()
+		<< " functions removed, " << oldSize - size << " bytes removed from .text." << endl;
+}
+
+// --merge-rodata: a labelled .rodata object reaches up to the next label. Objects with
+// the same bytes (and the same relocations in them) are kept once, the labels of the
+// copies are redirected to the first one. Only copies whose removal keeps the offsets
+// behind them aligned, and whose first copy is aligned at least as well, are folded.
+void Assembler::mergeRodata(){
+	Section& rodata = sections[RODATA];
+	if (!rodata.used || rodata.size == 0) return;
+	int size = rodata.size;
+
+	vector<int> starts;
+	for (auto& symbol : symbolTable)
+		if (symbol.section == RODATA && symbol.symType == LABEL && symbol.defined && symbol.offset < size)
+			starts.push_back(symbol.offset);
+	sort(starts.begin(), starts.end());
+	starts.erase(unique(starts.begin(), starts.end()), starts.end());
+	if (starts.size() < 2) return;
+
+	string image(2 * size, '0');
+	rodata.forEachChunk([&image](int offs, const string* bytes, int) {
+		if (bytes) image.replace(2 * offs, bytes->size(), *bytes);
+	});
+	auto alignOf = [&rodata](int offs) { return offs ? min(offs & -offs, rodata.align) : rodata.align; };
+
+	unordered_map<size_t, vector<int>> seen;   // hash -> objects with it
+	vector<string> keys(starts.size());
+	vector<Segment> segments;
+	int cursor = 0, removed = 0, folded = 0;
+	vector<int> newStart(starts.size());
+	// other passes append relocations, so the .rodata ones are picked out, not searched for
+	vector<Reloc> rels;
+	for (auto& reloc : relocations)
+		if (reloc.section == RODATA) rels.push_back(reloc);
+	stable_sort(rels.begin(), rels.end(), [](const Reloc& a, const Reloc& b) { return a.offset < b.offset; });
+	auto rel = rels.begin();
+	for (int i = 0; i < starts.size(); ++i) {
+		int start = starts[i], end = (i + 1 < starts.size()) ? starts[i + 1] : size;
+		newStart[i] = start - removed;
+		string& key = keys[i];
+		key = image.substr(2 * start, 2 * (end - start));
+		for (; rel != rels.end() && rel->offset < end; ++rel)
+			key += "|" + to_string(rel->offset - start) + "," + to_string(rel->symbol) + ","
+				+ to_string(rel->type) + "," + to_string(rel->addend);
+
+		vector<int>& same = seen[lineHash(key.data(), key.size())];
+		int first = -1;
+		for (int j : same)
+			if (keys[j] == key && alignOf(starts[j]) >= alignOf(start)) {
+				first = j;
+				break;
+			}
+		if (first == -1 || (end - start) % rodata.align) {
+			same.push_back(i);
+			continue;
+		}
+		if (start > cursor) segments.push_back({ cursor, start - cursor, cursor - removed, true });
+		segments.push_back({ start, end - start, newStart[first], false });
+		removed += end - start;
+		cursor = end;
+		folded++;
+	}
+	if (folded == 0) {
+		cout << "Rodata merge: 0 of " << starts.size() << " objects folded." << endl;
+		return;
+	}
+	if (size > cursor) segments.push_back({ cursor, size - cursor, cursor - removed, true });
+	rearrangeSection(RODATA, segments, size - removed);
+
+	cout << "Rodata merge: " << folded << " of " << starts.size() << " objects folded, "
+		<< removed << " bytes deduplicated in .rodata." << endl;
+}
+
+// maps an old offset through segments sorted by oldStart, -1 if the bytes were removed
+int Assembler::newOffset(const vector<Segment>& segments, int offs){
+	auto segment = upper_bound(segments.begin(), segments.end(), offs,
+		[](int o, const Segment& s) { return o < s.oldStart; });
+	if (segment == segments.begin()) return -1;
+	--segment;
+	if (offs > segment->oldStart + segment->length || segment->newStart == -1) return -1;
+	return segment->newStart + offs - segment->oldStart;
+}
+
+// moves the bytes of a section as described by segments and fixes everything
+// that depends on offsets in it: labels, relocation sites, section relative
+// values already encoded into the code and folded pc relative displacements;
+// a label in before that starts a segment stays at the end of the one in front of it
+void Assembler::rearrangeSection(int sec, const vector<Segment>& segments, int newSize, const unordered_set<int>& before){
+	Section& section = sections[sec];
+	vector<Segment> sorted = segments;
+	sort(sorted.begin(), sorted.end(), [](const Segment& a, const Segment& b) { return a.oldStart < b.oldStart; });
+	auto kept = [&sorted](int offs) {
+		auto segment = upper_bound(sorted.begin(), sorted.end(), offs,
+			[](int o, const Segment& s) { return o < s.oldStart; });
+		return segment != sorted.begin() && (--segment)->keep && offs < segment->oldStart + segment->length;
+	};
+	auto isLabel = [sec](const Symbol& symbol) {
+		return symbol.section == sec && symbol.symType == LABEL;
+	};
+	auto labelOffset = [this, &sorted, &before](int id) {
+		int offs = symbolTable[id].offset;
+		if (before.count(id))
+			for (auto& segment : sorted)
+				if (segment.keep && segment.oldStart + segment.length == offs) return segment.newStart + segment.length;
+		return newOffset(sorted, offs);
+	};
+	// .equ values computed from the labels change by what their labels move
+	vector<pair<int, int>> equMoves;
+	for (auto& equ : equLabels) {
+		int delta = 0;
+		for (auto& label : equ.second) {
+			Symbol& symbol = symbolTable[label.first];
+			int offs = isLabel(symbol) ? labelOffset(label.first) : -1;
+			if (offs != -1) delta += label.second * (offs - symbol.offset);
+		}
+		if (delta != 0) equMoves.push_back({ equ.first, delta });
+	}
+
+	// values are patched at the old sites, before the bytes move
+	for (auto& reloc : relocations) {
+		Symbol& symbol = symbolTable[reloc.symbol];
+		auto equ = find_if(equMoves.begin(), equMoves.end(), [&reloc](const pair<int, int>& e) { return e.first == reloc.symbol; });
+		if (equ != equMoves.end() && reloc.type == ABS && symbol.scope == LOCAL) {
+			Section& site = sections[reloc.section];
+			patchWord(site, reloc.offset, readWord(site, reloc.offset, reloc.bigEndian) + equ->second, reloc.bigEndian);
+			continue;
+		}
+		if (!isLabel(symbol) || (reloc.type != ABS && symbol.scope != LOCAL)) continue; // local pc relative: offset + addend
+		int target = labelOffset(reloc.symbol);
+		if (target == -1 || target == symbol.offset) continue;
+		Section& site = sections[reloc.section];
+		int value = readWord(site, reloc.offset, reloc.bigEndian);
+		if (symbol.scope == LOCAL) value += target - symbol.offset;
+		else if (value == symbol.offset) value = target;
+		patchWord(site, reloc.offset, value, reloc.bigEndian);
+	}
+	for (auto& fixup : fixups) {
+		if (fixup.section != sec) continue;
+		int site = newOffset(sorted, fixup.offset), target = labelOffset(fixup.symbol);
+		if (site == -1 || target == -1 || target - site == symbolTable[fixup.symbol].offset - fixup.offset) continue;
+		patchWord(section, fixup.offset, target + fixup.addend - site);
+	}
+
+	map<int, string> content;
+	for (auto& chunk : section.content)
+		if (kept(chunk.first)) content.emplace_hint(content.end(), newOffset(sorted, chunk.first), move(chunk.second));
+	section.content.swap(content);
+	map<int, int> zeroFill;
+	for (auto& range : section.zeroFill)
+		for (int offs = range.first, end = range.first + range.second; offs < end; ) {
+			auto segment = --upper_bound(sorted.begin(), sorted.end(), offs,
+				[](int o, const Segment& s) { return o < s.oldStart; });
+			int piece = min(end, segment->oldStart + segment->length) - offs;
+			if (segment->keep) zeroFill[newOffset(sorted, offs)] = piece;
+			offs += piece;
+		}
+	section.zeroFill.swap(zeroFill);
+	if (sec == TEXT) {
+		map<int, int> moved;
+		for (auto& cost : costs)
+			if (kept(cost.first)) moved.emplace_hint(moved.end(), newOffset(sorted, cost.first), cost.second);
+		costs.swap(moved);
+	}
+
+	for (int id = 0; id < symbolTable.size(); ++id)
+		if (isLabel(symbolTable[id])) {
+			Symbol& symbol = symbolTable[id];
+			int offs = labelOffset(id);
+			if (offs == -1) symbol.defined = false; // removed
+			else symbol.offset = offs;
+		}
+	for (auto& equ : equMoves) symbolTable[equ.first].offset += equ.second;
+	for (auto& reloc : relocations)
+		if (reloc.section == sec) {
+			if (kept(reloc.offset)) reloc.offset = newOffset(sorted, reloc.offset);
+			else reloc.symbol = -1;
+		}
+	relocations.erase(remove_if(relocations.begin(), relocations.end(), [](const Reloc& r) { return r.symbol == -1; }),
+		relocations.end());
+	for (auto& fixup : fixups)
+		if (fixup.section == sec) fixup.offset = kept(fixup.offset) ? newOffset(sorted, fixup.offset) : -1;
+	fixups.erase(remove_if(fixups.begin(), fixups.end(), [](const Reloc& r) { return r.offset == -1; }), fixups.end());
+	for (auto& site : exprSites)
+		if (site.section == sec) site.offset = kept(site.offset) ? newOffset(sorted, site.offset) : -1;
+	exprSites.erase(remove_if(exprSites.begin(), exprSites.end(), [](const ExprSite& s) { return s.offset == -1; }),
+		exprSites.end());
+
+	if (sec == TEXT) {
+		vector<int> ends;
+		for (int offs : flowEnds)
+			if (kept(offs - 1)) ends.push_back(newOffset(sorted, offs - 1) + 1);
+		sort(ends.begin(), ends.end());
+		flowEnds.swap(ends);
+		for (auto& counter : counters)
+			if (counter.first != -1) counter.first = newOffset(sorted, counter.first);
+	}
+	section.size = newSize;
+	symbolTable[sections[sec].symbol].size = newSize;
+	refoldExprs();
+}
@@ -0,0 +1,112 @@
+#include <cstring>
+#include <cstdint>
+#include <thread>
+#include "assembler.h"
+#include "pipeline.h"
+#include "scan.h"
+
+static const size_t minChunk = 1 << 20;    // smaller inputs aren't worth a thread
+
+// workers for bytes of source
+int Assembler::lexWorkers(size_t bytes){
+	int workers = (options.threads > 0) ? options.threads : (int)thread::hardware_concurrency();
+	if (workers < 1) workers = 1;
+	if (options.threads <= 0 && bytes / minChunk + 1 < (size_t)workers) workers = bytes / minChunk + 1;
+	return workers;
+}
+
+// input blocks give every worker of the pool a chunk
+size_t Assembler::lexBlockSize(){
+	return max((size_t)4 << 20, lexWorkers(SIZE_MAX) * minChunk);
+}
+
+// runs the tasks on the lexer threads, started with the first block that needs them
+void Assembler::lexParallel(int tasks, const function<void(int)>& task){
+	if (!lexPool) lexPool.reset(new WorkerPool(lexWorkers(SIZE_MAX)));
+	lexPool->run(tasks, task);
+}
+
+// the front end splits each input block at line ends into one chunk per worker; the workers
+// only find the lines, readBlock then walks them in order (conditionals, .equ constants and
+// .end need the rows one after another) and has the lines that aren't skipped tokenized
+void Assembler::lexInput(const string& source, LexedChunk& lexed){
+	int workers = lexWorkers(source.size());
+	vector<const char*> bounds{ source.data() };
+	const char* end = source.data() + source.size();
+	for (int i = 1; i < workers; ++i) {
+		const char* cut = source.data() + source.size() * i / workers;
+		if (cut <= bounds.back()) continue;
+		const char* eol = (const char*)memchr(cut, '\n', end - cut);
+		if (eol == nullptr) break;
+		bounds.push_back(eol + 1);
+	}
+	bounds.push_back(end);
+
+	vector<LexedChunk> chunks(bounds.size() - 1);
+	if (chunks.size() == 1) lexChunk(bounds[0], bounds[1], chunks[0]);
+	else lexParallel(chunks.size(), [&](int i) { lexChunk(bounds[i], bounds[i + 1], chunks[i]); });
+	lexed = move(chunks[0]);
+	for (int i = 1; i < chunks.size(); ++i) {
+		LexedChunk& chunk = chunks[i];
+		lexed.spans.insert(lexed.spans.end(), chunk.spans.begin(), chunk.spans.end());
+		for (int line : chunk.lines) lexed.lines.push_back(lexed.lineCount + line);
+		lexed.guarded.insert(lexed.guarded.end(), chunk.guarded.begin(), chunk.guarded.end());
+		lexed.lineCount += chunk.lineCount;
+	}
+	lexed.rows.resize(lexed.spans.size());
+	lexed.kinds.resize(lexed.spans.size());
+	if (options.watch) lexed.hashes.resize(lexed.spans.size());
+}
+
+// lines with at least one token, and whether they start with .if/.else/.endif
+// (looked at in skipped blocks); the first token is found with DelimiterScanner
+void Assembler::lexChunk(const char* begin, const char* end, LexedChunk& chunk){
+	DelimiterScanner scanner(begin, end);
+	for (const char* pos = begin; pos < end; ) {
+		chunk.lineCount++;
+		const char* lead = scanner.skip(pos);
+		const char* eol = (lead == end || *lead == '\n') ? lead : (const char*)memchr(lead, '\n', end - lead);
+		if (eol == nullptr) eol = end;
+		if (lead != eol) {
+			size_t rest = eol - lead;
+			chunk.guarded.push_back((rest >= 3 && !strncmp(lead, ".if", 3)) || (rest >= 5 && !strncmp(lead, ".else", 5))
+				|| (rest >= 6 && !strncmp(lead, ".endif", 6)));
+			chunk.spans.push_back({ pos, eol });
+			chunk.lines.push_back(chunk.lineCount);
+		}
+		pos = eol + 1;
+	}
+}
+
+// tokenizes and classifies the rows [first, last), on several threads when they are long
+void Assembler::lexRows(LexedChunk& lexed, int first, int last){
+	int workers = lexWorkers(lexed.spans[last - 1].second - lexed.spans[first].first);
+	if (workers > last - first) workers = last - first;
+	if (workers == 1) {
+		lexRange(lexed, first, last);
+		return;
+	}
+	lexParallel(workers, [&](int i) {
+		lexRange(lexed, first + (last - first) * i / workers, first + (last - first) * (i + 1) / workers); });
+}
+
+// tokens end at " ,\t" or at the end of the line, the boundaries come from the
+// delimiter masks of DelimiterScanner
+void Assembler::lexRange(LexedChunk& lexed, int first, int last){
+	if (first == last) return;
+	DelimiterScanner scanner(lexed.spans[first].first, lexed.spans[last - 1].second);
+	for (int k = first; k < last; ++k) {
+		const char* pos = lexed.spans[k].first, * eol = lexed.spans[k].second;
+		queue<string>& tokens = lexed.rows[k];
+		string second;
+		for (const char* start = scanner.skip(pos); start < eol; start = scanner.skip(pos)) {
+			pos = scanner.find(start);
+			tokens.push(string(start, pos));
+			if (tokens.size() == 2) second = tokens.back();
+		}
+		unsigned char kind = tokenParser(tokens.front()), statement = kind;
+		if (kind == LABEL) statement = (tokens.size() > 1) ? tokenParser(second) : INCORRECT;
+		lexed.kinds[k] = { kind, statement };
+		if (options.watch) lexed.hashes[k] = lineHash(lexed.spans[k].first, eol - lexed.spans[k].first);
+	}
+}
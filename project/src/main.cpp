@@ -2,26 +2,149 @@
 #include <fstream>
 #include <string>
 #include <string.h>
+#include <cstdlib>
+#include <chrono>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "assembler.h"
+#include "archive.h"
+#include "pipeline.h"
+#include "fileio.h"
 using namespace std;
 
+static FileIO* batchIO = nullptr;
+
+// the Assembler exits on an error in the source, the objects queued before it still get written
+static void finishBatch(){
+    if(batchIO) batchIO->finish();
+}
+
+// --batch: every source <name>.s is assembled to <name>.o, the sources are read ahead
+// and the objects written behind the assembler by FileIO (io_uring or a thread pool).
+// The batch stops at the first source with an error, its name is the last one printed.
+static int assembleBatch(const vector<string>& inputs, const string& ioKind, const AsmOptions& options){
+    auto start = chrono::steady_clock::now();
+    FileIO* io = FileIO::create(ioKind);
+    batchIO = io;
+    atexit(finishBatch);
+    io->prefetch(inputs);
+    for(int i = 0; i < inputs.size(); ++i){
+        string source;
+        if(!io->read(i, source)){
+            cout << "Error opening file " << inputs[i] << endl;
+            io->finish();
+            batchIO = nullptr;
+            delete io;
+            return 2;
+        }
+        cout << inputs[i] << ":" << endl;
+        istringstream in(source);
+        ostringstream out;
+        Assembler assembler(in, out, options);
+        assembler.compile();
+
+        size_t dot = inputs[i].find_last_of("./");
+        string object = (dot != string::npos && inputs[i][dot] == '.') ? inputs[i].substr(0, dot) : inputs[i];
+        io->write(object + ".o", out.str());
+    }
+    bool written = io->finish();
+    batchIO = nullptr;
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    cout << "Assembled " << inputs.size() << " files in " << ms << " ms (" << io->name() << ", "
+        << io->systemCalls() << " file system calls)." << endl;
+    delete io;
+    if(!written){
+        cout << "Error writing file" << endl;
+        return 2;
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[]){
 
     // asembler -o ulaz1.o ulaz1.s  // asembler ulaz1.s -o ulaz1.o 
-    string inFileName, outFileName;
-    if(argc == 4 && (strcmp(argv[1], "-o") == 0 || strcmp(argv[2], "-o") == 0)){
-        if(strcmp(argv[1], "-o") == 0){
-            outFileName = argv[2];
-            inFileName = argv[3];
-        } else{
-            inFileName = argv[1];
-            outFileName = argv[3];
+    // options: --layout-profile=<file> --gc-functions --entry=<label> --annotate-cost --instrument --watch -D<name>[=<value>] --hash-index --merge-rodata --threads=<n> --memory=<MB>
+    // asembler --ar arhiva.a ulaz1.o ulaz2.o  // asembler --ar-find arhiva.a simbol
+    // asembler --batch [--io=uring|threads] [options] ulaz1.s ulaz2.s ...  // ulaz1.o, ulaz2.o ...
+    if(argc >= 3 && strcmp(argv[1], "--ar") == 0){
+        Archive archive(argv[2]);
+        archive.update(vector<string>(argv + 3, argv + argc));
+        cout << "Archive " << argv[2] << " updated." << endl;
+        return 0;
+    }
+    if(argc == 4 && strcmp(argv[1], "--ar-find") == 0){
+        Archive archive(argv[2]);
+        string member = archive.find(argv[3]);
+        if(member.empty()){
+            cout << argv[3] << " is not defined in " << argv[2] << "." << endl;
+            return 1;
+        }
+        cout << argv[3] << ": " << member << endl;
+        return 0;
+    }
+
+    string inFileName, outFileName, ioKind;
+    vector<string> inputs;
+    bool batch = false;
+    AsmOptions options;
+    for(int i = 1; i < argc; ++i){
+        if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outFileName = argv[++i];
+        else if(strncmp(argv[i], "--layout-profile=", 17) == 0)
+            options.layoutProfile = argv[i] + 17;
+        else if(strcmp(argv[i], "--gc-functions") == 0)
+            options.gcFunctions = true;
+        else if(strncmp(argv[i], "--entry=", 8) == 0)
+            options.entry = argv[i] + 8;
+        else if(strcmp(argv[i], "--annotate-cost") == 0)
+            options.annotateCost = true;
+        else if(strcmp(argv[i], "--instrument") == 0)
+            options.instrument = true;
+        else if(strcmp(argv[i], "--watch") == 0)
+            options.watch = true;
+        else if(strcmp(argv[i], "--hash-index") == 0)
+            options.hashIndex = true;
+        else if(strcmp(argv[i], "--merge-rodata") == 0)
+            options.mergeRodata = true;
+        else if(strncmp(argv[i], "--threads=", 10) == 0)
+            options.threads = atoi(argv[i] + 10);
+        else if(strncmp(argv[i], "--memory=", 9) == 0 && atoi(argv[i] + 9) > 0)
+            options.memoryBudget = (size_t)atoi(argv[i] + 9) << 20;
+        else if(strncmp(argv[i], "-D", 2) == 0 && argv[i][2] != '\0'){
+            string define = argv[i] + 2;
+            size_t eq = define.find('=');
+            options.defines[define.substr(0, eq)] = (eq == string::npos) ? 1 : atoi(define.c_str() + eq + 1);
+        }
+        else if(strcmp(argv[i], "--batch") == 0)
+            batch = true;
+        else if(strncmp(argv[i], "--io=", 5) == 0)
+            ioKind = argv[i] + 5;
+        else if(argv[i][0] != '-')
+            inputs.push_back(argv[i]);
+        else {
+            cout << "Invalid arguments." << endl;
+            return 1;
+        }
+    }
+    // the passes that move code around and --watch need the whole program in memory
+    if(options.memoryBudget && (options.watch || options.gcFunctions || !options.layoutProfile.empty() || options.mergeRodata
+        || options.instrument || options.annotateCost)){
+        cout << "Error - --memory can't be used with --watch, --gc-functions, --layout-profile, --merge-rodata, --instrument or --annotate-cost." << endl;
+        return 1;
+    }
+    if(batch){
+        if(inputs.empty() || !outFileName.empty() || options.watch || (ioKind != "" && ioKind != "uring" && ioKind != "threads")){
+            cout << "Invalid arguments." << endl;
+            return 1;
         }
-    } else {
+        return assembleBatch(inputs, ioKind, options);
+    }
+    if(inputs.size() != 1 || outFileName.empty()){
         cout << "Invalid arguments." << endl;
         return 1;
     }
+    inFileName = inputs[0];
 
     ifstream inFile(inFileName);
     ofstream outFile(outFileName);
@@ -30,12 +153,49 @@ int main(int argc, char* argv[]){
         return 2;
     }
 
-    Assembler* assembler = new Assembler(inFile, outFile);
+    // the listing is written to disk on a writer thread while it is formatted
+    OutputPipe output(outFile);
+    Assembler* assembler = new Assembler(inFile, output, options);
     assembler->compile();
+    output.drain();
+    cout << "Relocations resolved at assembly time: " << assembler->eliminatedRelocs() << endl;
+
+    // --watch: the source is checked for changes until the process is stopped
+    struct stat st;
+    if(options.watch && stat(inFileName.c_str(), &st) == 0){
+        cout << "Watching " << inFileName << " (Ctrl+C to stop)" << endl;
+        struct timespec last = st.st_mtim;
+        while(true){
+            usleep(200000);
+            if(stat(inFileName.c_str(), &st) != 0) continue;
+            if(st.st_mtim.tv_sec == last.tv_sec && st.st_mtim.tv_nsec == last.tv_nsec) continue;
+            last = st.st_mtim;
+
+            auto start = chrono::steady_clock::now();
+            ifstream source(inFileName);
+            bool incremental = assembler->reassemble(source);
+            outFile.close();
+            outFile.open(outFileName, ios::trunc);
+            output.flags(ios::dec | ios::skipws);
+            output.fill(' ');
+            if(incremental)
+                assembler->writeListing();
+            else {
+                delete assembler;
+                source.clear();
+                source.seekg(0);
+                assembler = new Assembler(source, output, options);
+                assembler->compile();
+            }
+            output.drain();
+            auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+            cout << (incremental ? "Reassembled " : "Rebuilt ") << inFileName << " in " << ms << " ms." << endl;
+        }
+    }
 
     inFile.close();
     outFile.close();
     delete assembler;
 	cout << "Compiled! :)" << endl;
 	return 0;
-}
\ No newline at end of file
+}
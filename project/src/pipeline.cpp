@@ -0,0 +1,155 @@
+#include "pipeline.h"
+
+InputPipe::InputPipe(istream& in, size_t _blockSize, size_t depth)
+    : blocks(depth), blockSize(_blockSize), stop(false), done(false), reader(&InputPipe::read, this, ref(in)) {}
+
+InputPipe::~InputPipe(){
+    stop = true;    // the assembler can stop at .end before the input is over
+    reader.join();
+}
+
+void InputPipe::read(istream& in){
+    string carry;   // line started at the end of the last block
+    while (!stop) {
+        string block = move(carry);
+        size_t have = block.size();
+        block.resize(have + blockSize);
+        in.read(&block[have], blockSize);
+        block.resize(have + in.gcount());
+        bool last = in.gcount() == 0 || !in;
+        if (!last) {
+            size_t eol = block.rfind('\n');
+            if (eol == string::npos) {  // a line longer than a block, read on
+                carry = move(block);
+                continue;
+            }
+            carry = block.substr(eol + 1);
+            block.resize(eol + 1);
+        }
+        int tries = 0;
+        while (!block.empty() && !blocks.tryPush(block))
+            if (stop) return;
+            else pipelineWait(tries);
+        if (last) break;
+    }
+    done = true;
+}
+
+bool InputPipe::pop(string& block){
+    for (int tries = 0; !blocks.tryPop(block); pipelineWait(tries))
+        if (done && blocks.empty()) return false;
+    return true;
+}
+
+WorkerPool::WorkerPool(int workers){
+    for (int i = 1; i < workers; ++i) pool.emplace_back(&WorkerPool::work, this);
+}
+
+WorkerPool::~WorkerPool(){
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto& worker : pool) worker.join();
+}
+
+void WorkerPool::run(int tasks, const function<void(int)>& task){
+    {
+        lock_guard<mutex> guard(lock);
+        job = &task;
+        next = 0;
+        count = pending = tasks;
+    }
+    wake.notify_all();
+    for (int index; take(index); done()) task(index);
+    unique_lock<mutex> guard(lock);
+    ready.wait(guard, [this] { return pending == 0; });
+    job = nullptr;
+}
+
+void WorkerPool::work(){
+    while (true) {
+        const function<void(int)>* task;
+        int index;
+        {
+            unique_lock<mutex> guard(lock);
+            wake.wait(guard, [this] { return stop || next < count; });
+            if (next >= count) return;
+            task = job;
+            index = next++;
+        }
+        (*task)(index);
+        done();
+    }
+}
+
+// next task of the current run, false when all are handed out
+bool WorkerPool::take(int& index){
+    lock_guard<mutex> guard(lock);
+    if (next >= count) return false;
+    index = next++;
+    return true;
+}
+
+void WorkerPool::done(){
+    lock_guard<mutex> guard(lock);
+    if (--pending == 0) ready.notify_all();
+}
+
+OutputPipe::OutputPipe(ostream& out, size_t _blockSize, size_t depth)
+    : ostream(nullptr), buffer(*this), blocks(depth), blockSize(_blockSize), shipped(0), written(0), stop(false),
+      writer(&OutputPipe::write, this, ref(out)) {
+    buffer.fresh();
+    rdbuf(&buffer);
+}
+
+OutputPipe::~OutputPipe(){
+    drain();
+    stop = true;
+    writer.join();
+}
+
+void OutputPipe::drain(){
+    buffer.ship();
+    for (int tries = 0; written != shipped; ) pipelineWait(tries);
+}
+
+void OutputPipe::write(ostream& out){
+    string block;
+    for (int tries = 0; ; ) {
+        if (!blocks.tryPop(block)) {
+            if (stop) return;
+            pipelineWait(tries);
+            continue;
+        }
+        tries = 0;
+        out.write(block.data(), block.size());
+        if (blocks.empty()) out.flush();
+        written++;
+    }
+}
+
+void OutputPipe::Buffer::fresh(){
+    block.resize(pipe.blockSize);
+    setp(&block[0], &block[0] + block.size());
+}
+
+// the filled part of the block goes to the writer
+void OutputPipe::Buffer::ship(){
+    if (pptr() == pbase()) return;
+    block.resize(pptr() - pbase());
+    pipe.shipped++;
+    for (int tries = 0; !pipe.blocks.tryPush(block); ) pipelineWait(tries);
+    block = string();
+    fresh();
+}
+
+OutputPipe::Buffer::int_type OutputPipe::Buffer::overflow(int_type c){
+    ship();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
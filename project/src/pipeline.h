@@ -0,0 +1,128 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <istream>
+#include <ostream>
+
+using namespace std;
+
+// reader thread -> assembler -> writer thread, the stages are connected by
+// bounded single producer / single consumer queues
+
+// ring of capacity slots (a power of two); head and tail only grow, each is
+// written by one side, so push and pop need no lock
+template<class T> class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : slots(capacity), mask(capacity - 1), head(0), tail(0) {}
+
+    bool tryPush(T& item){
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == slots.size()) return false;   // full
+        slots[t & mask] = move(item);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+    bool tryPop(T& item){
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;                  // empty
+        item = move(slots[h & mask]);
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+    bool empty() const { return head.load(memory_order_acquire) == tail.load(memory_order_acquire); }
+
+private:
+    vector<T> slots;
+    size_t mask;
+    // padded rather than alignas(64): plain new can't allocate over-aligned types before c++17
+    char pad0[64];
+    atomic<size_t> head;                // next slot to pop
+    char pad1[64 - sizeof(atomic<size_t>)];
+    atomic<size_t> tail;                // next slot to push
+    char pad2[64 - sizeof(atomic<size_t>)];
+};
+
+// a stage with nothing to do spins a little, then sleeps - a waiting writer
+// mustn't take a core from the assembler
+inline void pipelineWait(int& tries){
+    if (++tries < 64) this_thread::yield();
+    else this_thread::sleep_for(chrono::microseconds(50));
+}
+
+// reads the input on its own thread in blocks that end at a line end
+class InputPipe {
+public:
+    explicit InputPipe(istream& in, size_t blockSize = 4 << 20, size_t depth = 4);
+    ~InputPipe();
+    bool pop(string& block);    // next block, false at the end of the input
+
+private:
+    void read(istream& in);
+
+    SpscQueue<string> blocks;
+    size_t blockSize;
+    atomic<bool> stop, done;
+    thread reader;
+};
+
+// threads kept for the whole input; run() hands out the tasks 0..tasks-1 to them and
+// to the calling thread, and returns when every task is done
+class WorkerPool {
+public:
+    explicit WorkerPool(int workers);
+    ~WorkerPool();
+    int size() const { return pool.size() + 1; }
+    void run(int tasks, const function<void(int)>& task);
+
+private:
+    void work();
+    bool take(int& index);
+    void done();
+
+    mutex lock;
+    condition_variable wake, ready;
+    const function<void(int)>* job = nullptr;
+    int next = 0, count = 0, pending = 0;
+    bool stop = false;
+    vector<thread> pool;
+};
+
+// ostream whose bytes go to out on a writer thread, in blocks of blockSize;
+// endl doesn't flush, drain() does
+class OutputPipe : public ostream {
+public:
+    explicit OutputPipe(ostream& out, size_t blockSize = 1 << 16, size_t depth = 16);
+    ~OutputPipe();
+    void drain();               // returns when everything written so far is in out
+
+private:
+    class Buffer : public streambuf {
+    public:
+        Buffer(OutputPipe& _pipe) : pipe(_pipe) {}
+        void fresh();
+        void ship();
+    protected:
+        int_type overflow(int_type c) override;
+    private:
+        OutputPipe& pipe;
+        string block;
+    };
+    void write(ostream& out);
+
+    Buffer buffer;
+    SpscQueue<string> blocks;
+    size_t blockSize;
+    atomic<size_t> shipped, written;
+    atomic<bool> stop;
+    thread writer;
+};
+
+#endif
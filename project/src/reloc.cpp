@@ -1,14 +1,12 @@
 #include "reloc.h" 
 
-Reloc::Reloc(string _name, string sec, int offs, RelocType t, int add):
-                name(_name), section(sec), offset(offs), type(t), addend(add) { }
+Reloc::Reloc(int sym, int sec, int offs, RelocType t, int add):
+                symbol(sym), offset(offs), addend(add), section(sec), type(t), bigEndian(false) { }
 
 ostream& operator<<(ostream& os, const Reloc& rel){
     if(rel.type == ABS)
-        os << hex << rel.offset << " R_x86_64_32" << "  " << rel.section;
+        os << hex << rel.offset << " R_x86_64_32" << "  " << dec << (int)rel.section;
     else
-        os << hex << rel.offset << " R_x86_64_PC32" << "      " << rel.name << " " << rel.addend;
+        os << hex << rel.offset << " R_x86_64_PC32" << "      " << dec << rel.symbol << " " << rel.addend;
 	return os << endl;
 }
-
-Reloc::~Reloc(){ }
\ No newline at end of file
@@ -3,22 +3,26 @@
 
 #include <iostream>
 #include <string>
+#include <type_traits>
+
+#include "symbol.h"
 
 using namespace std;
 
 enum RelocType { ABS, PCREL };
 
-class Reloc{
-public:
-    Reloc(string _name, string sec, int offs, RelocType _type, int add);
-	string name;
-	string section;
+struct Reloc{
+    Reloc(int sym, int sec, int offs, RelocType _type, int add);
+	int symbol;				// symbol id, -1 - resolved at assembly time
     int offset;
-    RelocType type;
 	int addend;
+	unsigned char section;	// section id
+    unsigned char type;		// RelocType
+    bool bigEndian;			// the field at offset is written high byte first (see CodeIR::bigEndian)
 
     friend ostream& operator<<(ostream& os, const Reloc& rel);
-    ~Reloc();
 };
 
-#endif
\ No newline at end of file
+static_assert(is_trivially_copyable<Reloc>::value && sizeof(Reloc) == 16, "Reloc layout");
+
+#endif
@@ -0,0 +1,63 @@
+#include "scan.h"
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+void scanBlockScalar(const char* p, uint64_t& delim, uint64_t& newline){
+	delim = newline = 0;
+	for (int i = 0; i < 64; ++i) {
+		if (p[i] == ' ' || p[i] == ',' || p[i] == '\t') delim |= 1ULL << i;
+		else if (p[i] == '\n') newline |= 1ULL << i;
+	}
+}
+
+#if defined(__SSE2__)
+void scanBlockSSE2(const char* p, uint64_t& delim, uint64_t& newline){
+	const __m128i space = _mm_set1_epi8(' '), comma = _mm_set1_epi8(','), tab = _mm_set1_epi8('\t'), eol = _mm_set1_epi8('\n');
+	delim = newline = 0;
+	for (int i = 0; i < 4; ++i) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + 16 * i));
+		__m128i d = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, comma)), _mm_cmpeq_epi8(v, tab));
+		delim |= (uint64_t)(uint16_t)_mm_movemask_epi8(d) << (16 * i);
+		newline |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, eol)) << (16 * i);
+	}
+}
+
+__attribute__((target("avx2")))
+void scanBlockAVX2(const char* p, uint64_t& delim, uint64_t& newline){
+	const __m256i space = _mm256_set1_epi8(' '), comma = _mm256_set1_epi8(','), tab = _mm256_set1_epi8('\t'), eol = _mm256_set1_epi8('\n');
+	delim = newline = 0;
+	for (int i = 0; i < 2; ++i) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(p + 32 * i));
+		__m256i d = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, comma)), _mm256_cmpeq_epi8(v, tab));
+		delim |= (uint64_t)(uint32_t)_mm256_movemask_epi8(d) << (32 * i);
+		newline |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, eol)) << (32 * i);
+	}
+}
+
+bool scanHasSSE2(){ return true; }
+bool scanHasAVX2(){ return __builtin_cpu_supports("avx2"); }
+#else
+void scanBlockSSE2(const char* p, uint64_t& delim, uint64_t& newline){ scanBlockScalar(p, delim, newline); }
+void scanBlockAVX2(const char* p, uint64_t& delim, uint64_t& newline){ scanBlockScalar(p, delim, newline); }
+bool scanHasSSE2(){ return false; }
+bool scanHasAVX2(){ return false; }
+#endif
+
+ScanKernel scanKernel(){
+	static const ScanKernel kernel = scanHasAVX2() ? scanBlockAVX2 : scanHasSSE2() ? scanBlockSSE2 : scanBlockScalar;
+	return kernel;
+}
+
+// the last block of the input can be shorter than 64 bytes, it is copied so the
+// kernels never read past the end
+void DelimiterScanner::load(const char* at){
+	block = at;
+	if (end - at >= 64) {
+		kernel(at, delim, newline);
+		return;
+	}
+	char tail[64] = { 0 };
+	for (int i = 0; at + i < end; ++i) tail[i] = at[i];
+	kernel(tail, delim, newline);
+}
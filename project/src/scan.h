@@ -0,0 +1,54 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+// fills bit i of delim when p[i] is one of " ,\t" and bit i of newline when it is '\n',
+// for the 64 bytes at p
+typedef void (*ScanKernel)(const char* p, uint64_t& delim, uint64_t& newline);
+
+void scanBlockScalar(const char*, uint64_t&, uint64_t&);
+void scanBlockSSE2(const char*, uint64_t&, uint64_t&);
+void scanBlockAVX2(const char*, uint64_t&, uint64_t&);
+bool scanHasSSE2();
+bool scanHasAVX2();
+ScanKernel scanKernel();    // AVX2 when the cpu has it, else SSE2, else scalar
+
+// token boundaries of [begin, end): the masks of one 64 byte block are kept
+// and searched with ctz, a new block is scanned only when a search leaves it
+class DelimiterScanner {
+public:
+    DelimiterScanner(const char* _begin, const char* _end, ScanKernel _kernel = scanKernel())
+        : begin(_begin), end(_end), block(0), kernel(_kernel) {}
+
+    // first byte at or behind p that isn't " ,\t" (a token, a '\n' or end)
+    const char* skip(const char* p) { return next(p, false); }
+    // first byte at or behind p that is " ,\t" or '\n' (end of a token)
+    const char* find(const char* p) { return next(p, true); }
+
+private:
+    const char* begin;
+    const char* end;
+    const char* block;
+    uint64_t delim, newline;
+    ScanKernel kernel;
+
+    const char* next(const char* p, bool stop){
+        while (p < end) {
+            if (block == 0 || p < block || p >= block + 64) load(begin + ((p - begin) & ~(ptrdiff_t)63));
+            uint64_t mask = (stop ? (delim | newline) : ~delim) >> (p - block);
+            if (mask) {
+                const char* hit = p + __builtin_ctzll(mask);
+                return (hit < end) ? hit : end;
+            }
+            p = block + 64;
+        }
+        return end;
+    }
+    void load(const char* at);
+};
+
+#endif
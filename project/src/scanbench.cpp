@@ -0,0 +1,140 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include "scan.h"
+
+using namespace std;
+
+// micro-benchmark of the line tokenizer: make bench, then
+// ./scanbench [<source file>] [--size=<MB>]   (default: 256 MB of generated code)
+
+static const char* sample[] = {
+	"main:\tmov %psw, %r1\n", "\tmov $1, %r2\n", "\tcall *getchar(%r7)\n", "\tcmp %r1, %r2\n",
+	"\tjne skip\n", "\tpush msg\n", "loop:\tadd $4, %sp\n", "\t.word 1, 2, 3, 527\n",
+	"\t.section .rodata\n", "msg:\t.byte 104, 101, 108, 108, 111, 0\n", "\n", "skip:\tmov $0, %r0\n",
+};
+
+struct Counts {
+	long long tokens, lines, bytes;
+	bool operator==(const Counts& c) const { return tokens == c.tokens && lines == c.lines && bytes == c.bytes; }
+};
+
+// the tokenizer as it was: find_first_of/find_first_not_of on every line
+static Counts tokenizeStrings(const string& text){
+	Counts counts = { 0, 0, 0 };
+	for (size_t pos = 0; pos < text.size(); ) {
+		size_t eol = text.find('\n', pos);
+		if (eol == string::npos) eol = text.size();
+		string line = text.substr(pos, eol - pos);
+		counts.lines++;
+		size_t start = line.find_first_not_of(" ,\t"), end;
+		while (start != string::npos) {
+			end = line.find_first_of(" ,\t", start);
+			if (end == string::npos) end = line.size();
+			counts.tokens++;
+			counts.bytes += end - start;
+			start = line.find_first_not_of(" ,\t", end);
+		}
+		pos = eol + 1;
+	}
+	return counts;
+}
+
+static Counts tokenizeMasks(const string& text, ScanKernel kernel){
+	Counts counts = { 0, 0, 0 };
+	const char* end = text.data() + text.size();
+	DelimiterScanner scanner(text.data(), end, kernel);
+	for (const char* pos = text.data(); pos < end; ) {
+		counts.lines++;
+		const char* eol = pos;
+		while (true) {
+			const char* start = scanner.skip(eol);
+			if (start == end || *start == '\n') {
+				eol = start;
+				break;
+			}
+			eol = scanner.find(start);
+			counts.tokens++;
+			counts.bytes += eol - start;
+		}
+		pos = eol + 1;
+	}
+	return counts;
+}
+
+// masks only, no token boundaries
+static Counts scanMasks(const string& text, ScanKernel kernel){
+	Counts counts = { 0, 0, 0 };
+	uint64_t delim, newline;
+	for (size_t pos = 0; pos + 64 <= text.size(); pos += 64) {
+		kernel(text.data() + pos, delim, newline);
+		counts.tokens += __builtin_popcountll(delim);
+		counts.lines += __builtin_popcountll(newline);
+	}
+	return counts;
+}
+
+template<class Run> static Counts measure(const char* name, size_t size, Run run){
+	auto start = chrono::steady_clock::now();
+	Counts counts = run();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << "  " << setw(22) << left << name << right << fixed << setprecision(2) << setw(8)
+		<< size / seconds / 1e9 << " GB/s" << setw(10) << seconds * 1000 << " ms" << endl;
+	return counts;
+}
+
+int main(int argc, char* argv[]){
+	string text, file;
+	size_t megabytes = 256;
+	for (int i = 1; i < argc; ++i) {
+		if (string(argv[i]).compare(0, 7, "--size=") == 0) megabytes = atoi(argv[i] + 7);
+		else file = argv[i];
+	}
+	if (!file.empty()) {
+		ifstream in(file, ios::binary);
+		if (!in.is_open()) {
+			cout << "Error opening file" << endl;
+			return 2;
+		}
+		text.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+	}
+	else {
+		text.reserve(megabytes << 20);
+		for (int i = 0; text.size() < (megabytes << 20); i = (i * 7 + 3) % 12) text += sample[i];
+	}
+	cout << text.size() / 1e6 << " MB, " << (scanHasAVX2() ? "AVX2" : scanHasSSE2() ? "SSE2" : "scalar")
+		<< " picked at runtime" << endl;
+
+	struct { const char* name; ScanKernel kernel; bool usable; } kernels[] = {
+		{ "scalar", scanBlockScalar, true },
+		{ "SSE2", scanBlockSSE2, scanHasSSE2() },
+		{ "AVX2", scanBlockAVX2, scanHasAVX2() },
+	};
+
+	cout << "tokenize:" << endl;
+	Counts expected = measure("find_first_of", text.size(), [&] { return tokenizeStrings(text); });
+	for (auto& k : kernels) {
+		if (!k.usable) continue;
+		Counts counts = measure((string(k.name) + " masks").c_str(), text.size(), [&] { return tokenizeMasks(text, k.kernel); });
+		if (!(counts == expected)) {
+			cout << "Error - " << k.name << " tokens differ." << endl;
+			return 1;
+		}
+	}
+	cout << "scan only:" << endl;
+	Counts reference = { 0, 0, 0 };
+	for (auto& k : kernels) {
+		if (!k.usable) continue;
+		Counts counts = measure(k.name, text.size(), [&] { return scanMasks(text, k.kernel); });
+		if (k.kernel == scanBlockScalar) reference = counts;
+		else if (!(counts == reference)) {
+			cout << "Error - " << k.name << " masks differ." << endl;
+			return 1;
+		}
+	}
+	cout << expected.lines << " lines, " << expected.tokens << " tokens" << endl;
+	return 0;
+}
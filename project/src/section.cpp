@@ -1,15 +1,30 @@
+#include <algorithm>
+#include <cstdlib>
 #include "section.h"
 
-Section::Section(string _name, int _size): 
-            name(_name), size(_size){ }
+Section::Section(string _name, int _size, string _flags): 
+            name(_name), flags(_flags.empty() ? defaultFlags(_name) : _flags), size(_size),
+            nobits(_name == ".bss" || _name.compare(0, 5, ".bss.") == 0), used(false), symbol(-1), align(1), spill(nullptr), spilledEnd(0){ }
+
+// flags of a section opened without them, by the name prefix (.text.hot is code as well)
+string Section::defaultFlags(const string& name){
+    auto prefix = [&name](const string& p) { return name == p || name.compare(0, p.length() + 1, p + ".") == 0; };
+    if(prefix(".text")) return "ax";
+    if(prefix(".data") || prefix(".bss")) return "aw";
+    return "a";
+}
 
 
 void Section::writeZeroBytes(int offs, int len){
-    int i = 0;
-    while(i < len){
-        pair<int, string> val(offs + i++, "00");
-        content.insert(val);
+    if(nobits || len <= 0) return;
+    if(!zeroFill.empty()){
+        auto last = --zeroFill.end();
+        if(last->first + last->second == offs){
+            last->second += len;
+            return;
+        }
     }
+    zeroFill.emplace_hint(zeroFill.end(), offs, len);
 }
 
 void Section::writeByte(int offs, string _byte){
@@ -22,4 +37,71 @@ void Section::writeBytes(int offs, string _bytes){
     content.insert(val);    
 }
 
+// overwrites already written bytes starting at offs (little endian order is up to the caller)
+void Section::patchBytes(int offs, string _bytes){
+    if(offs < spilledEnd){
+        patches[offs] = _bytes;
+        return;
+    }
+    auto chunk = content.upper_bound(offs);
+    if(chunk == content.begin()) return;
+    --chunk;
+    int pos = (offs - chunk->first) * 2;
+    if(pos >= chunk->second.length()) return;
+    int len = _bytes.length();
+    if(pos + len > chunk->second.length()) len = chunk->second.length() - pos;
+    chunk->second.replace(pos, len, _bytes.substr(0, len));
+}
+
+// hex digits of at most len bytes starting at offs, limited to the chunk holding offs
+// (spilled chunks aren't read back, the passes that need them don't run with --memory)
+string Section::readBytes(int offs, int len){
+    auto chunk = content.upper_bound(offs);
+    if(chunk == content.begin()) return "";
+    --chunk;
+    int pos = (offs - chunk->first) * 2;
+    if(pos >= chunk->second.length()) return "";
+    return chunk->second.substr(pos, 2 * len);
+}
+
+// --memory: chunks below end are appended to the spill file as
+// [offset][zero fill length][hex digits length][hex digits] records
+void Section::spillChunks(int end){
+    if(content.empty() && zeroFill.empty()) return;
+    if(!spill) spill = tmpfile();
+    if(!spill){
+        cout << "Error - Can't create a temporary file for " << name << "." << endl;
+        exit(1);
+    }
+    fseek(spill, 0, SEEK_END);
+    bool ok = true;
+    forEachResident([this, &ok](int offs, const string* bytes, int zeros) {
+        int header[3] = { offs, zeros, bytes ? (int)bytes->length() : 0 };
+        ok = ok && fwrite(header, sizeof(header), 1, spill) == 1;
+        if(bytes) ok = ok && fwrite(bytes->data(), 1, bytes->length(), spill) == bytes->length();
+    }, end);
+    if(!ok){
+        cout << "Error - Can't write the temporary file of " << name << "." << endl;
+        exit(1);
+    }
+    content.erase(content.begin(), content.lower_bound(end));
+    zeroFill.erase(zeroFill.begin(), zeroFill.lower_bound(end));
+    spilledEnd = max(spilledEnd, end);
+}
+
+// next record of the spill file, with the patches made after it was written
+bool Section::readSpilled(int& offs, string& bytes, int& zeros) const {
+    int header[3];
+    if(fread(header, sizeof(header), 1, spill) != 1) return false;
+    offs = header[0];
+    zeros = header[1];
+    bytes.resize(header[2]);
+    if(header[2] > 0 && fread(&bytes[0], 1, header[2], spill) != (size_t)header[2]) return false;
+    for(auto patch = patches.lower_bound(offs); patch != patches.end() && (patch->first - offs) * 2 < (int)bytes.length(); ++patch){
+        int pos = (patch->first - offs) * 2;
+        bytes.replace(pos, min(patch->second.length(), bytes.length() - pos), patch->second.substr(0, bytes.length() - pos));
+    }
+    return true;
+}
+
 Section::~Section(){ }
\ No newline at end of file
@@ -4,25 +4,80 @@
 #include <iostream>
 #include <map>
 #include <string>
+#include <cstdio>
+#include <climits>
 
 using namespace std;
 
+// part of a section moved by a layout pass: bytes [oldStart, oldStart + length)
+// end up at newStart, or are dropped (keep == false) and their labels are
+// redirected to newStart (-1 - removed together with the bytes)
+struct Segment {
+    int oldStart, length, newStart;
+    bool keep;
+};
+
 class Section{
 public:
-    Section(string _name, int _size);
+    Section(string _name, int _size, string _flags = "");
     Section(){cout<<"idioti"<<endl;}
     string name;
+    string flags;               // a - allocated, w - writable, x - code
     int size;
+    bool nobits;                // .bss - only the size is kept, nothing is written
+    bool used;                  // opened by .section (or made by a pass), listed
+    int symbol;                 // id of the section symbol, -1 before the section is opened
+    int align;                  // strictest alignment requested in the section
     map<int, string> content;
+    map<int, int> zeroFill;     // offset -> length of zero filled ranges
+    FILE* spill;                // --memory: chunks below spilledEnd, closed by the Assembler
+    int spilledEnd;
+    map<int, string> patches;   // --memory: bytes patched in the spilled chunks
     
+    bool code() const { return flags.find('x') != string::npos; }
+    static string defaultFlags(const string& name);
+
     void writeZeroBytes(int offs, int len);
     void writeByte(int offs, string _byte);
     void writeBytes(int offs, string _bytes);
+    void patchBytes(int offs, string _bytes);
+    string readBytes(int offs, int len);
+    void spillChunks(int end);
+
+    // visits chunks in offset order: visit(offset, bytes, 0) for written bytes,
+    // visit(offset, 0, length) for zero filled ranges
+    template<class Visit> void forEachChunk(Visit visit) const {
+        if (spill) {
+            int offs, zeros;
+            string bytes;
+            rewind(spill);
+            while (readSpilled(offs, bytes, zeros))
+                if (zeros) visit(offs, (const string*)0, zeros);
+                else visit(offs, &bytes, 0);
+        }
+        forEachResident(visit, INT_MAX);
+    }
 
     ~Section();
 
 private:
+    bool readSpilled(int& offs, string& bytes, int& zeros) const;
 
+    // chunks still in memory that start below end
+    template<class Visit> void forEachResident(Visit visit, int end) const {
+        auto c = content.begin();
+        auto z = zeroFill.begin();
+        auto below = [end](int offs) { return offs < end; };
+        while ((c != content.end() && below(c->first)) || (z != zeroFill.end() && below(z->first))) {
+            if (z == zeroFill.end() || !below(z->first) || (c != content.end() && c->first < z->first)) {
+                visit(c->first, &c->second, 0);
+                ++c;
+            } else {
+                visit(z->first, (const string*)0, z->second);
+                ++z;
+            }
+        }
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -5,36 +5,41 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <type_traits>
 
 using namespace std;
 
 enum ScopeType { LOCAL, GLOBAL, EXTERN };
+// ids of the predefined sections in Assembler::sections, sections named by
+// .section get the ids behind UND
 enum SectionType { START, TEXT, DATA, BSS, RODATA, UND };
 enum TokenType { LABEL, SECTION, SYMBOL, EXT_GLB, INSTRUCTION, INCORRECT, DIRECTIVE, OP_DEC, EQU, END };
 
+// one node of a symbol's forward reference list, all nodes live in Assembler::refPool
 struct forw_ref {
-	int patch;
-	string name;
+	int reloc;		// index of the relocation to patch (-1 - reference from an .equ)
+	int equ;		// symbol id of the .equ waiting for the value
+	int next;		// next node in the pool, -1 at the end of the list
 	int equ_sign;
-	forw_ref(int p , string s = "", int sign = 1): patch(p), name(s), equ_sign(sign) { }
+	forw_ref(int r, int e, int n, int sign = 1): reloc(r), equ(e), next(n), equ_sign(sign) { }
 };
 
 
-class Symbol{
-public:
-    Symbol(string lab, SectionType sec, int offs, ScopeType _scope, TokenType tok, int _size, bool def);
-    static int IDs; 
-    int serialNum; 
+// symbol id (serial number) is the index in Assembler::symbolTable
+struct Symbol{
+    Symbol(int lab, int sec, int offs, ScopeType _scope, TokenType tok, int _size, bool def);
 
-    string label;
-    SectionType section;
-    int offset; //value (case equ)
-    ScopeType scope;
+    int name;			// offset of the label in Assembler::strTab
+    int offset;			//value (case equ)
+	int size;			//numOfUndefinedSymbols (case equ)
+    int flink;			// first forward reference in Assembler::refPool, -1 if none
+    unsigned char section;	// section id
+    unsigned char scope;	// ScopeType
+    unsigned char symType;	// TokenType
     bool defined;
-    vector<forw_ref> flink;
-    TokenType symType;
-	int size; //numOfUndefinedSymbols (case equ)
-
 };
 
-#endif
\ No newline at end of file
+static_assert(is_trivially_copyable<forw_ref>::value && sizeof(forw_ref) == 16, "forw_ref layout");
+static_assert(is_trivially_copyable<Symbol>::value && sizeof(Symbol) == 20, "Symbol layout");
+
+#endif
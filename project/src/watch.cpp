@@ -0,0 +1,148 @@
+#include <cstring>
+#include <algorithm>
+#include "assembler.h"
+
+// --watch: the source is compared with the last assembled version row by row
+// (hashes of the source lines). When the only change is a run of instruction
+// lines in .text whose operands use symbols known before the run, just those
+// lines go through the front end and the encoder again, the code behind them is
+// shifted in place. Returns false when the edit needs a full rebuild.
+bool Assembler::reassemble(ifstream& in){
+	if (options.gcFunctions || options.instrument || !options.layoutProfile.empty() || options.mergeRodata
+		|| conditionals) return false;
+
+	// the whole file is read at once and lexed like a full build reads it
+	string source((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	LexedChunk lexed;
+	lexInput(source, lexed);
+	if (!lexed.spans.empty()) lexRows(lexed, 0, lexed.spans.size());
+	vector<int> lineNums;
+	vector<size_t> hashes;
+	for (int r = 0; r < lexed.spans.size(); ++r) {
+		if (lexed.guarded[r]) return false; // rows depend on the conditions
+		hashes.push_back(lexed.hashes[r]);
+		lineNums.push_back(lexed.lines[r]);
+		if (lexed.rows[r].front() == ".end") break;
+	}
+
+	// old rows [r0, r1) became new rows [r0, n1)
+	int oldRows = rowHash.size(), newRows = hashes.size();
+	int r0 = 0, tail = 0;
+	while (r0 < oldRows && r0 < newRows && rowHash[r0] == hashes[r0]) r0++;
+	while (tail < oldRows - r0 && tail < newRows - r0 && rowHash[oldRows - 1 - tail] == hashes[newRows - 1 - tail]) tail++;
+	int r1 = oldRows - tail, n1 = newRows - tail;
+
+	if (r0 != r1 || r0 != n1) {
+		if (r1 >= oldRows || lineState[r0].section != TEXT) return false;
+		for (int r = r0; r < r1; ++r)
+			if (lineState[r].kind != INSTRUCTION) return false;
+		int known = lineState[r0].symbols;
+		for (int i = lineState[r0].code; i < lineState[r1].code; ++i)
+			for (int k = 0; k < code.numOper[i]; ++k)
+				if (code.ref[k][i] == EXPR_ABS || code.ref[k][i] == EXPR_PCREL) {
+					for (auto& name : exprNames(code.exprs[code.value[k][i]]))
+						if (symbolId(name) >= known) return false;
+				}
+				else if (code.ref[k][i] != LITERAL && code.value[k][i] >= known) return false;
+
+		static const regex name{ "(^|[^%a-zA-Z0-9_])([a-zA-Z_][a-zA-Z0-9_]*)" };
+		vector<queue<string>> rows;
+		for (int r = r0; r < n1; ++r) {
+			if (lexed.kinds[r].first != INSTRUCTION) return false;
+			queue<string> operands = lexed.rows[r];
+			for (operands.pop(); !operands.empty(); operands.pop())
+				for (sregex_iterator it(operands.front().begin(), operands.front().end(), name), last; it != last; ++it) {
+					int id = symbolId((*it)[2]);
+					if (id == -1 || id >= known) return false; // would change the symbol order
+					if (symbolTable[id].defined && definedRow[id] >= r0) return false; // byte order, see CodeIR::bigEndian
+				}
+			rows.push_back(move(lexed.rows[r]));
+		}
+
+		Section& text = sections[TEXT];
+		int editStart = lineState[r0].offset, oldEnd = lineState[r1].offset, oldSize = text.size;
+		int i0 = lineState[r0].code, i1 = lineState[r1].code;
+
+		// front end of the new lines, behind the IR; costs are kept aside until the code is moved
+		map<int, int> oldCosts, newCosts;
+		oldCosts.swap(costs);
+		int section = currSection;
+		currSection = TEXT;
+		locationCnt = editStart;
+		int first = code.rows();
+		vector<int> starts, ends;
+		for (int r = r0; r < n1; ++r) {
+			string instr = rows[r - r0].front(), dst = (rows[r - r0].size() > 1) ? rows[r - r0].back() : "";
+			rows[r - r0].pop();
+			starts.push_back(locationCnt);
+			instructionHandler(instr, rows[r - r0], lineNums[r]);
+			if (endsFlow(instrName[instr], dst)) ends.push_back(locationCnt);
+		}
+		currSection = section;
+		newCosts.swap(costs);
+		costs.swap(oldCosts);
+		int delta = locationCnt - oldEnd;
+		text.size = oldSize;
+		if (delta % text.align) return false; // .align behind the edit would need other padding
+
+		// everything the old lines produced
+		for (int i = i0; i < i1; ++i) relocsEliminated -= code.folded[i];
+		auto inEdit = [editStart, oldEnd](int offs) { return offs > editStart && offs < oldEnd; };
+		text.content.erase(text.content.lower_bound(editStart), text.content.lower_bound(oldEnd));
+		costs.erase(costs.lower_bound(editStart), costs.lower_bound(oldEnd));
+		relocations.erase(remove_if(relocations.begin(), relocations.end(),
+			[&inEdit](const Reloc& r) { return r.section == TEXT && inEdit(r.offset); }), relocations.end());
+		fixups.erase(remove_if(fixups.begin(), fixups.end(),
+			[&inEdit](const Reloc& r) { return r.section == TEXT && inEdit(r.offset); }), fixups.end());
+		exprSites.erase(remove_if(exprSites.begin(), exprSites.end(),
+			[&inEdit](const ExprSite& s) { return s.section == TEXT && inEdit(s.offset); }), exprSites.end());
+		flowEnds.erase(remove_if(flowEnds.begin(), flowEnds.end(),
+			[editStart, oldEnd](int offs) { return offs > editStart && offs <= oldEnd; }), flowEnds.end());
+
+		if (delta != 0) {
+			vector<Segment> segments;
+			segments.push_back({ 0, editStart, 0, true });
+			segments.push_back({ oldEnd, oldSize - oldEnd, oldEnd + delta, true });
+			// inserted lines go behind the labels of the rows above them
+			unordered_set<int> before;
+			if (editStart == oldEnd)
+				for (int id = 0; id < symbolTable.size(); ++id)
+					if (symbolTable[id].section == TEXT && symbolTable[id].symType == LABEL && symbolTable[id].defined
+						&& symbolTable[id].offset == editStart && definedRow[id] < r0) before.insert(id);
+			rearrangeSection(TEXT, segments, oldSize + delta, before);
+			if (lineState[r0].label != -1) symbolTable[lineState[r0].label].size += delta;
+		}
+		costs.insert(newCosts.begin(), newCosts.end());
+		flowEnds.insert(flowEnds.end(), ends.begin(), ends.end());
+		sort(flowEnds.begin(), flowEnds.end());
+
+		int added = code.rows() - first;
+		code.splice(i0, i1 - i0, first);
+		for (int i = i0 + added; i < code.rows(); ++i)
+			if (code.section[i] == TEXT) code.offset[i] += delta;
+		encodeInstructions(i0, i0 + added);
+		stable_sort(relocations.begin(), relocations.end(), [](const Reloc& a, const Reloc& b) {
+			return a.section < b.section || (a.section == b.section && a.offset < b.offset); });
+
+		vector<LineState> states;
+		for (int k = 0; k < added; ++k)
+			states.push_back({ starts[k], lineState[r0].symbols, lineState[r0].label, i0 + k, TEXT, INSTRUCTION });
+		for (int r = r1; r < oldRows; ++r) {
+			LineState& state = lineState[r];
+			if (state.section == TEXT && state.offset >= oldEnd) state.offset += delta;
+			state.code += added - (i1 - i0);
+		}
+		for (auto& row : definedRow)
+			if (row != INT_MAX && row >= r1) row += n1 - r1;
+		lineState.erase(lineState.begin() + r0, lineState.begin() + r1);
+		lineState.insert(lineState.begin() + r0, states.begin(), states.end());
+	}
+
+	rowHash.swap(hashes);
+	inputLines.swap(lineNums);
+	for (int r = 0; r < lineState.size(); ++r) {
+		int next = (r + 1 < lineState.size()) ? lineState[r + 1].code : code.rows();
+		if (next > lineState[r].code) code.line[lineState[r].code] = inputLines[r];
+	}
+	return true;
+}